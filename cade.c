@@ -13,11 +13,35 @@
  * Licensed under the GNU Lesser General Public License, v3.
 */
 
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined __AVX2__ || defined __SSE2__
+#include <immintrin.h>
+#elif defined __ARM_NEON
+#include <arm_neon.h>
+#endif
+
 #include "cade.h"
 
+/* Tracing of every emulated cycle, to stdout. Compiled in only when CADE_TRACE is defined,
+ * since it dominates the run time of anything else the emulator does.
+*/
+#if defined CADE_TRACE
+#define	TRACE(...)	printf(__VA_ARGS__)
+#else
+#define	TRACE(...)
+#endif
+
 /* -------------------------------------------------------------------------- */
 
 /** \file cade.c
@@ -113,26 +137,97 @@ struct Thunk
 /** \brief The size of the emulated DCPU-16's memory. */
 #define	MEM_SIZE	0x10000
 
+/** \brief The size, in words, of the pages used to track which memory has been written. */
+#define	PAGE_SIZE	0x100
+
+/** \brief The number of pages in the emulated DCPU-16's memory. */
+#define	PAGE_COUNT	(MEM_SIZE / PAGE_SIZE)
+
+/** \brief The number of counters in DCPU_Metrics. */
+#define	METRICS_COUNT	(sizeof (DCPU_Metrics) / sizeof (uint64_t))
+
+/** \brief How many cycles may pass between publishing counters to other threads. */
+#define	METRICS_INTERVAL	0x4000
+
+/** \brief Number of bits of the cycle counter covered by each level of a timer wheel. */
+#define	WHEEL_BITS	6
+
+/** \brief Number of slots in each level of a timer wheel. */
+#define	WHEEL_SLOTS	(1 << WHEEL_BITS)
+
+/** \brief Number of levels of a timer wheel, enough to cover the whole cycle counter. */
+#define	WHEEL_LEVELS	((64 + WHEEL_BITS - 1) / WHEEL_BITS)
+
+/** \brief A hierarchical timer wheel, holding the scheduled events of devices.
+ *
+ * A device due at a cycle that shares all but the lowest WHEEL_BITS bits with \c now is in
+ * level 0, in the slot given by those bits. Otherwise it is in the level of the highest group
+ * of WHEEL_BITS bits that differs, in the slot given by that group. Only the earliest slot of
+ * the lowest occupied level ever needs looking at; higher levels are cascaded down to lower
+ * ones as \c now reaches them.
+*/
+typedef struct {
+	uint64_t	now;				/**< The cycle the wheel was last advanced to. */
+	uint64_t	occupied[WHEEL_LEVELS];		/**< Bitmaps of the non-empty slots of each level. */
+	DCPU_Device	*slots[WHEEL_LEVELS][WHEEL_SLOTS];	/**< Lists of devices due in each slot. */
+} Wheel;
+
 /** \brief Internal representation of the state of the emulated DCPU-16.
  *
  * This structure is not public, use the API to access the state of
  * the emulated DCPU-16.
 */
 struct DCPU_State {
+	uint16_t	memory[MEM_SIZE];		/**< The machine's memory. */
 	uint16_t	registers[DCPU_REG_COUNT];	/**< The registers, indexed by DCPU_Register. */
 	uint16_t	sp;				/**< The stack pointer. */
 	uint16_t	pc;				/**< The program counter. */
 	uint16_t	o;				/**< The overflow register. */
-	uint16_t	memory[MEM_SIZE];		/**< The machine's memory. */
 
 	Thunk		cycle;				/**< Function to execute for next clock cycle. */
 	uint16_t	inst;				/**< Currently-executing instruction. */
+	uint16_t	inst_pc;			/**< Address the current instruction was fetched from. */
 	uint16_t	*val_a, *val_b;			/**< Pointers at resolved values from current instruction, or NULL. */
 	uint16_t	dummy;				/**< Target for invalid value (SET of literal). */
-	uint32_t	timer;				/**< Instruction-counter. */
+	uint64_t	timer;				/**< Cycle counter. */
 	unsigned char	skip;				/**< Signals that the next instruction is to be skipped due to IFx. */
+
+	uint32_t	dirty[PAGE_COUNT / 32];		/**< Bitmap of pages written since the last clear. */
+	uint64_t	page_hash[PAGE_COUNT];		/**< Digest of each page, the XOR of hash_word() of its words. */
+	uint64_t	memory_hash;			/**< The XOR of all page digests. */
+	uint32_t	hash_stale[PAGE_COUNT / 32];	/**< Bitmap of pages whose digests need to be recomputed. */
+	uint8_t		*coverage;			/**< Edge coverage map, DCPU_COVERAGE_SIZE bytes, or NULL. */
+	DCPU_Display	*display;			/**< Attached display, or NULL. */
+	DCPU_History	*history;			/**< Attached execution history, or NULL. */
+	uint64_t	next_event;			/**< Value of timer at which handle_events() must next run. */
+	uint32_t	watch;				/**< Address whose writes are recorded in watch_hit, or MEM_SIZE for none. */
+	uint64_t	watch_hit;			/**< Value of timer after the latest write to the watched address. */
+	uint64_t	run_end;			/**< Value of timer at which DCPU_Run() runs out of budget. */
+	uint64_t	step_end;			/**< Value of timer that loops may be run natively up to, or 0 to not run them natively. */
+	DCPU_RunStatus	stop;				/**< Reason for DCPU_Run() to stop, or 0 to keep running. */
+	atomic_uint	stop_request;			/**< Set by DCPU_RequestStop(), from any thread, until the CPU stops for it. */
+	unsigned char	stopped;			/**< Set when the latest call running the CPU stopped for DCPU_RequestStop(). */
+	unsigned char	replaying;			/**< Set while stepping back replays the history, which stop requests wait out. */
+	unsigned char	looped;				/**< Set when an instruction has jumped to itself. */
+	unsigned char	loop_entered;			/**< Set when an instruction has jumped back to what may be the start of a loop. */
+	unsigned char	io_waiting;			/**< Set when the guest has written to the I/O port, until DCPU_CompleteIO(). */
+	uint32_t	io_port;			/**< Address of the I/O port, or MEM_SIZE for none. */
+	uint16_t	io_request;			/**< Value the guest wrote to the I/O port. */
+	size_t		breakpoint_count;		/**< Number of addresses set in breakpoints. */
+	uint32_t	breakpoints[MEM_SIZE / 32];	/**< Bitmap of addresses that DCPU_Run() stops at. */
+	DCPU_Device	*devices;			/**< List of attached devices. */
+	uint32_t	device_pages[PAGE_COUNT];	/**< Number of devices mapped into each page. */
+	Wheel		wheel;				/**< Scheduled events of the attached devices. */
+
+	DCPU_Metrics	metrics;			/**< Counters, only touched by the thread running the CPU. */
+	uint64_t	metrics_published_at;		/**< Value of metrics.cycles when the counters were last published. */
+	atomic_uint	metrics_sequence;		/**< Sequence lock for published, odd while it's being written. */
+	_Atomic uint64_t published[METRICS_COUNT];	/**< Copy of the counters that other threads can read. */
 };
 
+/** \brief Size of the part of DCPU_State that is the emulated machine, as opposed to host-side bookkeeping. */
+#define	MACHINE_SIZE	offsetof(DCPU_State, dirty)
+
 /* -------------------------------------------------------------------------- */
 
 /** \brief Returns a string containing the name of the indicated register.
@@ -150,9 +245,9 @@ const char * DCPU_GetRegisterName(DCPU_Register reg)
 
 static unsigned int DCPU_ValueLength(unsigned char value)
 {
-	if(value < VAL_SUCC)
-		return 0;
-	if(value <= VAL_SUCC_LIT)
+	if(value >= VAL_SUCC_REG_A && value <= VAL_SUCC_REG_J)
+		return 1;
+	if(value == VAL_SUCC || value == VAL_SUCC_LIT)
 		return 1;
 	return 0;
 }
@@ -162,85 +257,246 @@ unsigned int DCPU_InstructionLength(uint16_t inst)
 {
 	if(inst & 0xf)
 		return 1 + DCPU_ValueLength((inst >> 4) & 0x3f) + DCPU_ValueLength((inst >> 10) & 0x3f);
-	else
+	/* Non-basic instructions have their single value where basic ones have b. */
+	return 1 + DCPU_ValueLength((inst >> 10) & 0x3f);
+}
+
+/* Scrambles the bits of a 64-bit value; this is the finalizer of the SplitMix64 generator. */
+static uint64_t hash_mix(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ull;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebull;
+	x ^= x >> 31;
+
+	return x;
+}
+
+/* Hashes a single word of memory, together with its address. Zero words hash to zero,
+ * so that freshly cleared memory has all-zero page digests.
+*/
+static uint64_t hash_word(uint16_t address, uint16_t value)
+{
+	return value != 0 ? hash_mix((uint64_t) address << 16 | value) : 0;
+}
+
+static void display_written(DCPU_Display *display, uint16_t address, uint16_t old, uint16_t value);
+static void display_changed(DCPU_Display *display, uint16_t address, size_t length);
+static void history_changed(DCPU_State *cpu);
+static void device_read(DCPU_State *cpu, uint16_t address);
+static void device_written(DCPU_State *cpu, uint16_t address, uint16_t value);
+
+/* Notes that a range of memory has been written all at once. The pages covering it are marked
+ * as written, and their digests as stale.
+*/
+static void memory_stored(DCPU_State *cpu, uint16_t address, size_t length)
+{
+	size_t	page, last;
+
+	if(length == 0)
+		return;
+	if(cpu->display != NULL)
+		display_changed(cpu->display, address, length);
+	for(page = address / PAGE_SIZE, last = (address + length - 1) / PAGE_SIZE; page <= last; page++)
 	{
-		fprintf(stderr, "**Can't compute length of non-basic instruction 0x%04x\n", inst);
+		cpu->dirty[page / 32] |= 1u << (page % 32);
+		cpu->hash_stale[page / 32] |= 1u << (page % 32);
 	}
-	return 1;
+}
+
+/* Notes that a range of memory has been replaced wholesale by the host, rather than by the CPU,
+ * which an execution history can't replay.
+*/
+static void memory_changed(DCPU_State *cpu, uint16_t address, size_t length)
+{
+	memory_stored(cpu, address, length);
+	if(cpu->history != NULL && length > 0)
+		history_changed(cpu);
+}
+
+/* Notes that a word of memory has been written, word by word: the page is marked as written,
+ * and its digest updated unless that is going to be recomputed anyway.
+*/
+static void memory_written(DCPU_State *cpu, uint16_t address, uint16_t old, uint16_t value)
+{
+	const uint16_t	page = address / PAGE_SIZE;
+
+	cpu->dirty[page / 32] |= 1u << (page % 32);
+	if((cpu->hash_stale[page / 32] & (1u << (page % 32))) == 0)
+	{
+		const uint64_t	delta = hash_word(address, old) ^ hash_word(address, value);
+
+		cpu->page_hash[page] ^= delta;
+		cpu->memory_hash ^= delta;
+	}
+	if(cpu->display != NULL)
+		display_written(cpu->display, address, old, value);
+}
+
+/* Returns whether an instruction is a SET into [register], as loops run by loop_accelerate() start with. */
+static int loop_candidate(uint16_t inst)
+{
+	const unsigned int	a = (inst >> 4) & 0x3f;
+
+	return (inst & 0xf) == OP_SET && a >= VAL_DEREF_REG_A && a <= VAL_DEREF_REG_J;
+}
+
+/* Stores a value at a resolved value pointer. Stores into memory mark the page as written,
+ * and update its digest unless that is going to be recomputed anyway.
+*/
+static void store(DCPU_State *cpu, uint16_t *target, uint16_t value)
+{
+	const uintptr_t	offset = (uintptr_t) target - (uintptr_t) cpu->memory;
+	const uint16_t	old = *target;
+
+	*target = value;
+	if(offset < sizeof cpu->memory)
+	{
+		const uint16_t	address = offset / sizeof *cpu->memory;
+
+		cpu->metrics.memory_writes++;
+		memory_written(cpu, address, old, value);
+		if(cpu->device_pages[address / PAGE_SIZE] != 0)
+			device_written(cpu, address, value);
+		if(address == cpu->watch)
+			cpu->watch_hit = cpu->timer + 1;
+		if(address == cpu->io_port)
+		{
+			cpu->io_request = value;
+			cpu->io_waiting = 1;
+			cpu->next_event = 0;
+		}
+	}
+	else if(target == &cpu->pc)
+	{
+		if(value == cpu->inst_pc)
+		{
+			cpu->looped = 1;
+			cpu->next_event = 0;
+		}
+		/* Loops go around by jumping back, which makes that the place to look for stop requests. */
+		else if(value < cpu->inst_pc)
+		{
+			if(atomic_load_explicit(&cpu->stop_request, memory_order_relaxed))
+				cpu->next_event = 0;
+			/* Jumping back to a SET into [register] may be looping over memory, see loop_accelerate(). */
+			else if(cpu->step_end > cpu->timer && loop_candidate(cpu->memory[value]))
+			{
+				cpu->loop_entered = 1;
+				cpu->next_event = 0;
+			}
+		}
+	}
+}
+
+/* Records a control flow edge in the coverage map, if there is one. */
+static void record_edge(DCPU_State *cpu, uint16_t from, uint16_t to)
+{
+	if(cpu->coverage != NULL)
+	{
+		uint8_t	*count = &cpu->coverage[((from * 0x9e37u) ^ to) & (DCPU_COVERAGE_SIZE - 1)];
+
+		/* Skips 0 when the count wraps around, so that an edge taken a multiple of 256 times still shows. */
+		*count += 1 + (*count == 255);
+	}
+}
+
+/* Values of the short-form literals, which resolve to pointers into here. */
+static uint16_t	literals[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
+			       17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31 };
+
+/* Accounts for a memory operand. It is counted as read, unless it's the target of SET and only
+ * going to be written, and any device mapped there is brought up to date before it's used.
+*/
+static void memory_operand(DCPU_State *cpu, int dest, const uint16_t *value)
+{
+	const uint16_t	address = value - cpu->memory;
+
+	if(!dest || (cpu->inst & 0xf) != OP_SET)
+		cpu->metrics.memory_reads++;
+	if(cpu->device_pages[address / PAGE_SIZE] != 0)
+		device_read(cpu, address);
 }
 
 /* Evaluates the given value. Returns how many cycles where spent, i.e. 0 or 1. */
 static int eval_value(DCPU_State *cpu, DCPU_Value value, int dest, uint16_t **value_result)
 {
-	static uint16_t	literals[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
-				       17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31 };
-
-	printf("evaluating value %c (%x)\n", "ba"[dest], value);
+	TRACE("evaluating value %c (%x)\n", "ba"[dest], value);
 	if(value >= VAL_REG_A && value <= VAL_REG_J)
 	{
 		/* Register value, evaluates immediately. */
 		*value_result = &cpu->registers[value];
-		printf(" register %c (current value 0x%04x)\n", "ABCXYZIJ"[value - VAL_REG_A], **value_result);
+		TRACE(" register %c (current value 0x%04x)\n", "ABCXYZIJ"[value - VAL_REG_A], **value_result);
 	}
 	else if(value >= VAL_DEREF_REG_A && value <= VAL_DEREF_REG_J)
 	{
-		*value_result = &cpu->memory[cpu->memory[cpu->registers[value - VAL_DEREF_REG_A]]];
-		printf(" register indirect, address 0x%04x\n", (unsigned short) (*value_result - cpu->memory));
+		*value_result = &cpu->memory[cpu->registers[value - VAL_DEREF_REG_A]];
+		memory_operand(cpu, dest, *value_result);
+		TRACE(" register indirect, address 0x%04x\n", (unsigned short) (*value_result - cpu->memory));
 	}
 	else if(value >= VAL_SUCC_REG_A && value <= VAL_SUCC_REG_J)
 	{
 		const uint16_t	succ = cpu->memory[cpu->pc++];
 
-		*value_result = &cpu->memory[succ + cpu->registers[value - VAL_SUCC_REG_A]];
-		printf(" indexing, address 0x%04x\n", (unsigned short) (*value_result - cpu->memory));
+		*value_result = &cpu->memory[(uint16_t) (succ + cpu->registers[value - VAL_SUCC_REG_A])];
+		cpu->metrics.memory_reads++;
+		memory_operand(cpu, dest, *value_result);
+		TRACE(" indexing, address 0x%04x\n", (unsigned short) (*value_result - cpu->memory));
 		return 1;
 	}
 	else if(value == VAL_POP)
 	{
 		*value_result = &cpu->memory[cpu->sp++];
-		printf(" POP, value 0x%04x\n", **value_result);
+		memory_operand(cpu, dest, *value_result);
+		TRACE(" POP, value 0x%04x\n", **value_result);
 	}
 	else if(value == VAL_PEEK)
 	{
 		*value_result = &cpu->memory[cpu->sp];
-		printf(" PEEK, value 0x%04x\n", **value_result);
+		memory_operand(cpu, dest, *value_result);
+		TRACE(" PEEK, value 0x%04x\n", **value_result);
 	}
 	else if(value == VAL_PUSH)
 	{
 		*value_result = &cpu->memory[--cpu->sp];
-		printf(" PUSH, value 0x%04x\n", **value_result);
+		memory_operand(cpu, dest, *value_result);
+		TRACE(" PUSH, value 0x%04x\n", **value_result);
 	}
 	else if(value == VAL_SP)
 	{
 		*value_result = &cpu->sp;
-		printf(" SP, value 0x%04x\n", **value_result);
+		TRACE(" SP, value 0x%04x\n", **value_result);
 	}
 	else if(value == VAL_PC)
 	{
 		*value_result = &cpu->pc;
-		printf(" PC target\n");
+		TRACE(" PC target\n");
 	}
 	else if(value == VAL_O)
 	{
 		*value_result = &cpu->o;
-		printf(" O, value 0x%04x\n", **value_result);
+		TRACE(" O, value 0x%04x\n", **value_result);
 	}
 	else if(value == VAL_SUCC)
 	{
 		*value_result = &cpu->memory[cpu->memory[cpu->pc++]];
-		printf(" memory target, address 0x%04x\n", (unsigned short) (*value_result - cpu->memory));
+		cpu->metrics.memory_reads++;
+		memory_operand(cpu, dest, *value_result);
+		TRACE(" memory target, address 0x%04x\n", (unsigned short) (*value_result - cpu->memory));
 		return 1;
 	}
 	else if(value == VAL_SUCC_LIT)
 	{
 		*value_result = &cpu->memory[cpu->pc++];
-		printf(" literal, value 0x%04x\n", **value_result);
+		cpu->metrics.memory_reads++;
+		TRACE(" literal, value 0x%04x\n", **value_result);
 		return 1;
 	}
 	else if(value >= 0x20 && value <= 0x3f)
 	{
 		*value_result = dest ? &cpu->dummy : literals + (value - 0x20);
-		printf(" small literal, value 0x%02x\n", **value_result);
+		TRACE(" small literal, value 0x%02x\n", **value_result);
 	}
 	else
 		fprintf(stderr, "**Unhandled value type 0x%x\n", value);
@@ -257,7 +513,7 @@ static Thunk get_cycle_refetch(DCPU_State *cpu)
 	cpu->inst = 0;
 	cpu->val_a = NULL;
 	cpu->val_b = NULL;
-	printf("ending cycle %u\n", cpu->timer++);
+	TRACE("ending cycle %" PRIu64 "\n", cpu->timer);
 
 	return next;
 }
@@ -266,9 +522,9 @@ static Thunk cycle_add(DCPU_State *cpu)
 {
 	const uint32_t	tmp = *cpu->val_a + *cpu->val_b;
 
-	*cpu->val_a = tmp & 0xffff;
+	store(cpu, cpu->val_a, tmp & 0xffff);
 	cpu->o = (tmp > 0xffff);
-	printf("in ADD, ending cycle %u\n", cpu->timer++);
+	TRACE("in ADD, ending cycle %" PRIu64 "\n", cpu->timer);
 
 	return get_cycle_refetch(cpu);
 }
@@ -277,9 +533,9 @@ static Thunk cycle_sub(DCPU_State *cpu)
 {
 	const uint32_t	tmp = *cpu->val_a - *cpu->val_b;
 
-	*cpu->val_a = tmp & 0xffff;
+	store(cpu, cpu->val_a, tmp & 0xffff);
 	cpu->o = (tmp > 0xffff) ? 0xffff : 0;
-	printf("in SUB, ending cycle %u\n", cpu->timer++);
+	TRACE("in SUB, ending cycle %" PRIu64 "\n", cpu->timer);
 
 	return get_cycle_refetch(cpu);
 }
@@ -288,7 +544,7 @@ static Thunk cycle_mul(DCPU_State *cpu)
 {
 	const uint32_t	tmp = *cpu->val_a * *cpu->val_b;
 
-	*cpu->val_a = tmp & 0xffff;
+	store(cpu, cpu->val_a, tmp & 0xffff);
 	cpu->o = (tmp >> 16) & 0xffff;
 
 	return get_cycle_refetch(cpu);
@@ -296,7 +552,7 @@ static Thunk cycle_mul(DCPU_State *cpu)
 
 static Thunk cycle_divmod2(DCPU_State *cpu)
 {
-	printf("in middle cycle of DIV/MOD, ending cycle %u\n", cpu->timer++);
+	TRACE("in middle cycle of DIV/MOD, ending cycle %" PRIu64 "\n", cpu->timer);
 
 	return get_cycle_refetch(cpu);
 }
@@ -305,18 +561,20 @@ static Thunk cycle_div1(DCPU_State *cpu)
 {
 	const Thunk	next_div2 = { cycle_divmod2 };
 
+	cpu->metrics.divmods++;
 	if(*cpu->val_b != 0)
 	{
-		const uint32_t	tmp = (*cpu->val_a << 16) / *cpu->val_b;
+		const uint32_t	tmp = ((uint32_t) *cpu->val_a << 16) / *cpu->val_b;
 
-		*cpu->val_a = *cpu->val_a / *cpu->val_b;
+		store(cpu, cpu->val_a, *cpu->val_a / *cpu->val_b);
 		cpu->o = tmp >> 16;
 	}
 	else
 	{
-		*cpu->val_a = cpu->o = 0;
+		store(cpu, cpu->val_a, 0);
+		cpu->o = 0;
 	}
-	printf("in first cycle of DIV, ending cycle %u\n", cpu->timer++);
+	TRACE("in first cycle of DIV, ending cycle %" PRIu64 "\n", cpu->timer);
 
 	return next_div2;
 }
@@ -325,23 +583,24 @@ static Thunk cycle_mod1(DCPU_State *cpu)
 {
 	const Thunk	next_mod2 = { cycle_divmod2 };
 
+	cpu->metrics.divmods++;
 	if(*cpu->val_b != 0)
 	{
-		*cpu->val_a = *cpu->val_a % *cpu->val_b;
+		store(cpu, cpu->val_a, *cpu->val_a % *cpu->val_b);
 	}
 	else
-		*cpu->val_a = 0;
+		store(cpu, cpu->val_a, 0);
 
-	printf("in first cycle of MOD, ending cycle %u\n", cpu->timer++);
+	TRACE("in first cycle of MOD, ending cycle %" PRIu64 "\n", cpu->timer);
 
 	return next_mod2;
 }
 
 static Thunk cycle_shl(DCPU_State *cpu)
 {
-	const uint32_t	res = *cpu->val_a << *cpu->val_b;
+	const uint32_t	res = *cpu->val_b < 32 ? (uint32_t) *cpu->val_a << *cpu->val_b : 0;
 
-	*cpu->val_a = (res & 0xffff);
+	store(cpu, cpu->val_a, res & 0xffff);
 	cpu->o = res >> 16;
 
 	return get_cycle_refetch(cpu);
@@ -349,18 +608,20 @@ static Thunk cycle_shl(DCPU_State *cpu)
 
 static Thunk cycle_shr(DCPU_State *cpu)
 {
-	const uint32_t	res = *cpu->val_a >> *cpu->val_b;
+	const uint32_t	res = *cpu->val_b < 32 ? *cpu->val_a >> *cpu->val_b : 0;
 
-	cpu->o = (*cpu->val_a << 16) >> *cpu->val_b;
-	*cpu->val_a = (res & 0xffff);
+	cpu->o = *cpu->val_b < 32 ? ((uint32_t) *cpu->val_a << 16) >> *cpu->val_b : 0;
+	store(cpu, cpu->val_a, res & 0xffff);
 
 	return get_cycle_refetch(cpu);
 }
 
 static Thunk cycle_if(DCPU_State *cpu)
 {
-	printf(" in IF, burning a cycle\n");
-	printf("ending cycle %u\n", cpu->timer++);
+	TRACE(" in IF, burning a cycle\n");
+	cpu->metrics.ifs_taken += !cpu->skip;
+	cpu->metrics.ifs_not_taken += cpu->skip;
+	TRACE("ending cycle %" PRIu64 "\n", cpu->timer);
 
 	return get_cycle_refetch(cpu);
 }
@@ -369,19 +630,26 @@ static Thunk cycle_skip(DCPU_State *cpu)
 {
 	const uint16_t	inst = cpu->memory[cpu->pc];
 
-	printf("skip of instruction 0x%04x\n", inst);
+	TRACE("skip of instruction 0x%04x\n", inst);
 	cpu->pc += DCPU_InstructionLength(inst);
 	cpu->skip = 0;
+	cpu->metrics.skipped++;
+	record_edge(cpu, cpu->inst_pc, cpu->pc);
 
 	return get_cycle_refetch(cpu);
 }
 
 static Thunk cycle_jsr(DCPU_State *cpu)
 {
-	printf(" in JSR\n");
-	cpu->memory[--cpu->sp] = cpu->pc;
+	TRACE(" in JSR\n");
+	--cpu->sp;
+	store(cpu, &cpu->memory[cpu->sp], cpu->pc);
 	cpu->pc = *cpu->val_a;
-	printf("ending cycle %u\n", cpu->timer++);
+	record_edge(cpu, cpu->inst_pc, cpu->pc);
+	/* Calling backwards can loop too, see store(). */
+	if(cpu->pc <= cpu->inst_pc && atomic_load_explicit(&cpu->stop_request, memory_order_relaxed))
+		cpu->next_event = 0;
+	TRACE("ending cycle %" PRIu64 "\n", cpu->timer);
 
 	return get_cycle_refetch(cpu);
 }
@@ -402,12 +670,18 @@ static Thunk cycle_fetch(DCPU_State *cpu)
 		{
 			const Thunk	skip = { cycle_skip };
 
-			printf(" SKIP\n");
-			printf(" ending cycle %u\n", cpu->timer++);
+			TRACE(" SKIP\n");
+			TRACE(" ending cycle %" PRIu64 "\n", cpu->timer);
 			return skip;
 		}
+		/* Running off the end of memory goes back to the start without a jump, see store(). */
+		if(cpu->pc < cpu->inst_pc && atomic_load_explicit(&cpu->stop_request, memory_order_relaxed))
+			cpu->next_event = 0;
+		cpu->inst_pc = cpu->pc;
 		cpu->inst = cpu->memory[cpu->pc++];
-		printf("Cycle %u: fetched instruction 0x%04x from 0x%04x\n", cpu->timer, cpu->inst, cpu->pc - 1);
+		cpu->metrics.instructions++;
+		cpu->metrics.memory_reads++;
+		TRACE("Cycle %" PRIu64 ": fetched instruction 0x%04x from 0x%04x\n", cpu->timer, cpu->inst, cpu->pc - 1);
 		if(cpu->skip)
 		{
 			cpu->skip = 0;
@@ -422,7 +696,7 @@ static Thunk cycle_fetch(DCPU_State *cpu)
 		{
 			if(eval_value(cpu, (cpu->inst >> 10) & 0x3f, 0, &cpu->val_a))
 			{
-				printf(" ending cycle %u\n", cpu->timer++);
+				TRACE(" ending cycle %" PRIu64 "\n", cpu->timer);
 				return cpu->cycle;
 			}
 		}
@@ -433,7 +707,7 @@ static Thunk cycle_fetch(DCPU_State *cpu)
 		{
 			if(eval_value(cpu, (cpu->inst >> 4) & 0x3f, 1, &cpu->val_a))
 			{
-				printf(" ending cycle %u\n", cpu->timer++);
+				TRACE(" ending cycle %" PRIu64 "\n", cpu->timer);
 				return cpu->cycle;
 			}
 		}
@@ -441,7 +715,7 @@ static Thunk cycle_fetch(DCPU_State *cpu)
 		{
 			if(eval_value(cpu, (cpu->inst >> 10) & 0x3f, 0, &cpu->val_b))
 			{
-				printf(" ending cycle %u\n", cpu->timer++);
+				TRACE(" ending cycle %" PRIu64 "\n", cpu->timer);
 				return cpu->cycle;
 			}
 		}
@@ -453,7 +727,7 @@ static Thunk cycle_fetch(DCPU_State *cpu)
 	{
 	case OP_NOBASIC:
 		{
-			printf("running extended op\n");
+			TRACE("running extended op\n");
 			switch((DCPU_ExtendedOp) ((cpu->inst >> 4) & 0x3f))
 			{
 			case XOP_JSR:
@@ -463,61 +737,63 @@ static Thunk cycle_fetch(DCPU_State *cpu)
 		}
 		break;
 	case OP_SET:
-		printf("executing SET (a at %p, b at %p, dummy at %p)\n", cpu->val_a, cpu->val_b, &cpu->dummy);
-		*cpu->val_a = *cpu->val_b;
+		TRACE("executing SET (a at %p, b at %p, dummy at %p)\n", cpu->val_a, cpu->val_b, &cpu->dummy);
+		store(cpu, cpu->val_a, *cpu->val_b);
+		if(cpu->val_a == &cpu->pc)
+			record_edge(cpu, cpu->inst_pc, cpu->pc);
 		break;
 	case OP_ADD:
-		printf("executing ADD\n");
+		TRACE("executing ADD\n");
 		return next_add;
 	case OP_SUB:
-		printf("executing SUB\n");
+		TRACE("executing SUB\n");
 		return next_sub;
 	case OP_MUL:
-		printf("executing MUL\n");
+		TRACE("executing MUL\n");
 		return next_mul;
 	case OP_DIV:
-		printf("executing DIV\n");
+		TRACE("executing DIV\n");
 		return next_div;
 	case OP_MOD:
-		printf("executing MOD\n");
+		TRACE("executing MOD\n");
 		return next_mod;
 	case OP_SHL:
-		printf("evaluating SHL\n");
+		TRACE("evaluating SHL\n");
 		return next_shl;
 	case OP_SHR:
-		printf("evaluating SHR\n");
+		TRACE("evaluating SHR\n");
 		return next_shr;
 	case OP_AND:
-		printf("evaluating AND\n");
-		*cpu->val_a &= *cpu->val_b;
+		TRACE("evaluating AND\n");
+		store(cpu, cpu->val_a, *cpu->val_a & *cpu->val_b);
 		break;
 	case OP_BOR:
-		printf("evaluating BOR\n");
-		*cpu->val_a |= *cpu->val_b;
+		TRACE("evaluating BOR\n");
+		store(cpu, cpu->val_a, *cpu->val_a | *cpu->val_b);
 		break;
 	case OP_XOR:
-		printf("evaluating XOR\n");
-		*cpu->val_a ^= *cpu->val_b;
+		TRACE("evaluating XOR\n");
+		store(cpu, cpu->val_a, *cpu->val_a ^ *cpu->val_b);
 		break;
 	case OP_IFE:
-		printf("evaluating IFE [%04x == 0x%04x]\n", *cpu->val_a, *cpu->val_b);
+		TRACE("evaluating IFE [%04x == 0x%04x]\n", *cpu->val_a, *cpu->val_b);
 		cpu->skip = !(*cpu->val_a == *cpu->val_b);
-		printf(" set skip to %u\n", cpu->skip);
+		TRACE(" set skip to %u\n", cpu->skip);
 		return next_if;
 	case OP_IFN:
-		printf("evaluating IFN [0x%04x != 0x%04x]\n", *cpu->val_a, *cpu->val_b);
+		TRACE("evaluating IFN [0x%04x != 0x%04x]\n", *cpu->val_a, *cpu->val_b);
 		cpu->skip = !(*cpu->val_a != *cpu->val_b);
-		printf(" set skip to %u\n", cpu->skip);
+		TRACE(" set skip to %u\n", cpu->skip);
 		return next_if;
 	case OP_IFG:
-		printf("evaluating IFG [0x%04x > 0x%04x]\n", *cpu->val_a, *cpu->val_b);
+		TRACE("evaluating IFG [0x%04x > 0x%04x]\n", *cpu->val_a, *cpu->val_b);
 		cpu->skip = !(*cpu->val_a > *cpu->val_b);
-		printf(" set skip to %u\n", cpu->skip);
+		TRACE(" set skip to %u\n", cpu->skip);
 		return next_if;
 	case OP_IFB:
-		printf("evaluating IFB [0x%04x > 0x%04x]\n", *cpu->val_a, *cpu->val_b);
+		TRACE("evaluating IFB [0x%04x > 0x%04x]\n", *cpu->val_a, *cpu->val_b);
 		cpu->skip = !((*cpu->val_a & *cpu->val_b) != 0);
-		printf(" set skip to %u\n", cpu->skip);
+		TRACE(" set skip to %u\n", cpu->skip);
 		return next_if;
 	default:
 		fprintf(stderr, "**No implementation for opcode 0x%x\n", cpu->inst & 0xf);
@@ -525,32 +801,184 @@ static Thunk cycle_fetch(DCPU_State *cpu)
 	/* Done with the instruction, clear state. */
 	cpu->inst = 0;
 	cpu->val_a = cpu->val_b = NULL;
-	printf(" ending cycle %u\n", cpu->timer++);
+	TRACE(" ending cycle %" PRIu64 "\n", cpu->timer);
 
 	return cpu->cycle;
 }
 
+/* Every function the CPU can execute a cycle with. The index into this table identifies a
+ * pipeline stage in a way that doesn't depend on where the code was loaded.
+*/
+static const Thunk	thunks[] = {
+	{ cycle_fetch }, { cycle_add }, { cycle_sub }, { cycle_mul }, { cycle_div1 }, { cycle_mod1 },
+	{ cycle_divmod2 }, { cycle_shl }, { cycle_shr }, { cycle_if }, { cycle_skip }, { cycle_jsr }
+};
+
+/* Returns the index of a cycle function in thunks[]. */
+static unsigned int thunk_index(Thunk thunk)
+{
+	unsigned int	i;
+
+	for(i = 0; i < sizeof thunks / sizeof *thunks; i++)
+	{
+		if(thunks[i].execute == thunk.execute)
+			return i;
+	}
+	return 0;
+}
+
+/** \brief Kinds of locations a resolved value pointer can refer to, used in value_ref(). */
+enum {
+	REF_NONE = 0,
+	REF_MEMORY,
+	REF_REGISTER,
+	REF_SPECIAL,
+	REF_LITERAL
+};
+
+/* Encodes a resolved value pointer as a location kind in the upper 16 bits and an index in
+ * the lower, so that it doesn't depend on where the instance lives in host memory.
+*/
+static uint32_t value_ref(const DCPU_State *cpu, const uint16_t *value)
+{
+	const uintptr_t	memory = (uintptr_t) value - (uintptr_t) cpu->memory;
+	const uintptr_t	literal = (uintptr_t) value - (uintptr_t) literals;
+
+	if(value == NULL)
+		return REF_NONE << 16;
+	if(memory < sizeof cpu->memory)
+		return REF_MEMORY << 16 | memory / sizeof *value;
+	if(value >= cpu->registers && value < cpu->registers + DCPU_REG_COUNT)
+		return REF_REGISTER << 16 | (value - cpu->registers);
+	if(literal < sizeof literals)
+		return REF_LITERAL << 16 | literal / sizeof *value;
+	if(value == &cpu->sp)
+		return REF_SPECIAL << 16 | 0;
+	if(value == &cpu->pc)
+		return REF_SPECIAL << 16 | 1;
+	if(value == &cpu->o)
+		return REF_SPECIAL << 16 | 2;
+	return REF_SPECIAL << 16 | 3;
+}
+
+/* Returns a pointer relocated from one instance to another, if it pointed into the first one. */
+static uint16_t * rebase_value(DCPU_State *dst, const DCPU_State *src, uint16_t *value)
+{
+	const uintptr_t	offset = (uintptr_t) value - (uintptr_t) src;
+
+	if(value != NULL && offset < sizeof *src)
+		return (uint16_t *) ((char *) dst + offset);
+	return value;
+}
+
+static void schedule_events(DCPU_State *cpu);
+
+/* Copies registers and pipeline state, but not memory, between instances. */
+static void copy_registers(DCPU_State *dst, const DCPU_State *src)
+{
+	memcpy(dst->registers, src->registers, MACHINE_SIZE - offsetof(DCPU_State, registers));
+	dst->val_a = rebase_value(dst, src, src->val_a);
+	dst->val_b = rebase_value(dst, src, src->val_b);
+	schedule_events(dst);
+}
+
+/* Decodes a value pointer encoded by value_ref(). Returns 0 if the encoding is invalid. */
+static int value_unref(DCPU_State *cpu, uint32_t ref, uint16_t **value)
+{
+	uint16_t * const	specials[] = { &cpu->sp, &cpu->pc, &cpu->o, &cpu->dummy };
+	const uint16_t		index = ref & 0xffff;
+
+	switch(ref >> 16)
+	{
+	case REF_NONE:
+		*value = NULL;
+		return 1;
+	case REF_MEMORY:
+		*value = &cpu->memory[index];
+		return 1;
+	case REF_REGISTER:
+		*value = &cpu->registers[index];
+		return index < DCPU_REG_COUNT;
+	case REF_SPECIAL:
+		*value = specials[index & 3];
+		return index < 4;
+	case REF_LITERAL:
+		*value = &literals[index & 31];
+		return index < 32;
+	}
+	return 0;
+}
+
+/** \brief The registers and pipeline state of an instance, in a form that doesn't depend on where it lives. */
+typedef struct {
+	uint16_t	registers[DCPU_REG_COUNT];	/**< The registers, indexed by DCPU_Register. */
+	uint16_t	sp, pc, o;			/**< The special registers. */
+	uint16_t	inst, inst_pc, dummy;		/**< The current instruction, where it came from, and the dummy target. */
+	uint8_t		skip;				/**< Set if the next instruction is to be skipped. */
+	uint8_t		cycle;				/**< Index of the next cycle's function in thunks[]. */
+	uint32_t	val_a, val_b;			/**< Resolved values, encoded by value_ref(). */
+	uint64_t	timer;				/**< Cycle counter. */
+} Registers;
+
+/* Saves the registers and pipeline state of an instance. */
+static void registers_save(const DCPU_State *cpu, Registers *regs)
+{
+	memcpy(regs->registers, cpu->registers, sizeof regs->registers);
+	regs->sp = cpu->sp;
+	regs->pc = cpu->pc;
+	regs->o = cpu->o;
+	regs->inst = cpu->inst;
+	regs->inst_pc = cpu->inst_pc;
+	regs->dummy = cpu->dummy;
+	regs->skip = cpu->skip;
+	regs->cycle = thunk_index(cpu->cycle);
+	regs->val_a = value_ref(cpu, cpu->val_a);
+	regs->val_b = value_ref(cpu, cpu->val_b);
+	regs->timer = cpu->timer;
+}
+
+/* Loads registers and pipeline state saved by registers_save(), possibly from another instance. */
+static void registers_load(DCPU_State *cpu, const Registers *regs)
+{
+	memcpy(cpu->registers, regs->registers, sizeof cpu->registers);
+	cpu->sp = regs->sp;
+	cpu->pc = regs->pc;
+	cpu->o = regs->o;
+	cpu->inst = regs->inst;
+	cpu->inst_pc = regs->inst_pc;
+	cpu->dummy = regs->dummy;
+	cpu->skip = regs->skip;
+	cpu->cycle = thunks[regs->cycle];
+	value_unref(cpu, regs->val_a, &cpu->val_a);
+	value_unref(cpu, regs->val_b, &cpu->val_b);
+	cpu->timer = regs->timer;
+}
+
 /* -------------------------------------------------------------------------- */
 
 /** \brief Creates a new DCPU-16 instance.
  *
  * Memory is dynamically allocated to hold the emulated CPU's state; use DCPU_Destroy() to free it.
+ * It is mapped directly from the operating system, so that the emulated memory is page-aligned
+ * and DCPU_StateFileRestore() can map saved memory straight into it.
 */
 DCPU_State * DCPU_Create(void)
 {
 	DCPU_State	*cpu;
 
-	if((cpu = malloc(sizeof *cpu)) != NULL)
+	if((cpu = mmap(NULL, sizeof *cpu, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) != MAP_FAILED)
 	{
 		DCPU_Init(cpu);
+		return cpu;
 	}
-	return cpu;
+	return NULL;
 }
 
 /** \brief Destroys a DCPU-16 instance. */
 void DCPU_Destroy(DCPU_State *cpu)
 {
-	free(cpu);
+	if(cpu != NULL)
+		munmap(cpu, sizeof *cpu);
 }
 
 /** \brief Initializes (resets) the state of an emulated DCPU-16 instance.
@@ -558,15 +986,41 @@ void DCPU_Destroy(DCPU_State *cpu)
  * All memory and registers (including PC and O) are cleared to 0x0000, and the
  * stack pointer is set to 0xffff. Any executing instruction is aborted, on the
  * next cycle executed the DCPU-16 will fetch a new instruction to execute.
+ *
+ * This also detaches any coverage map set with DCPU_SetCoverageMap(), any
+ * display created with DCPU_DisplayCreate(), any history created with
+ * DCPU_HistoryCreate(), and any devices created with DCPU_DeviceCreate().
 */
 void DCPU_Init(DCPU_State *cpu)
 {
 	memset(cpu, 0, sizeof *cpu);
 	cpu->sp = 0xffff;
 	cpu->cycle.execute = cycle_fetch;
+	cpu->next_event = METRICS_INTERVAL;
+	cpu->watch = MEM_SIZE;
+	cpu->run_end = UINT64_MAX;
+	cpu->io_port = MEM_SIZE;
+}
+
+static void copy_words(uint16_t *dst, const uint8_t *src, size_t count, int swap);
+
+/* Loads words into memory from a byte buffer, wrapping around from the end of memory to the start. */
+static void load_words(DCPU_State *cpu, uint16_t address, const uint8_t *data, size_t length, int swap)
+{
+	const size_t	first = length < (size_t) MEM_SIZE - address ? length : (size_t) MEM_SIZE - address;
+
+	if(length > MEM_SIZE)
+		length = MEM_SIZE;
+	copy_words(cpu->memory + address, data, first, swap);
+	memory_changed(cpu, address, first);
+	copy_words(cpu->memory, data + 2 * first, length - first, swap);
+	memory_changed(cpu, 0, length - first);
 }
 
 /** \brief Loads some data into the emulated DPCU-16's memory.
+ *
+ * Data that doesn't fit before the end of memory wraps around to the start of it, like
+ * addresses do. At most the size of memory is loaded.
  *
  * \param address The address where the first word will be loaded.
  * \param data Pointer to data to load from.
@@ -574,7 +1028,19 @@ void DCPU_Init(DCPU_State *cpu)
 */
 void DCPU_Load(DCPU_State *cpu, uint16_t address, const uint16_t *data, size_t length)
 {
-	memcpy(cpu->memory + address, data, length * sizeof *data);
+	load_words(cpu, address, (const uint8_t *) data, length, 0);
+}
+
+/** \brief Sets a map that receives edge coverage information as the CPU runs.
+ *
+ * Every taken <tt>SET PC</tt>, \c JSR and \c IFx skip increments a byte of the map,
+ * selected by hashing the addresses of the branch and its target together.
+ *
+ * \param map A map of DCPU_COVERAGE_SIZE bytes, or \c NULL to stop recording coverage.
+*/
+void DCPU_SetCoverageMap(DCPU_State *cpu, uint8_t *map)
+{
+	cpu->coverage = map;
 }
 
 /** \brief Prints the state of the emulated DCPU-16 instance.
@@ -668,6 +1134,292 @@ uint16_t DCPU_GetMemory(const DCPU_State *cpu, uint16_t address)
 
 /* -------------------------------------------------------------------------- */
 
+/* Copies the counters to where other threads can read them. */
+static void metrics_publish(DCPU_State *cpu)
+{
+	const uint64_t	*counters = (const uint64_t *) &cpu->metrics;
+	const unsigned int	sequence = atomic_load_explicit(&cpu->metrics_sequence, memory_order_relaxed);
+	size_t		i;
+
+	atomic_store_explicit(&cpu->metrics_sequence, sequence + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	for(i = 0; i < METRICS_COUNT; i++)
+		atomic_store_explicit(&cpu->published[i], counters[i], memory_order_relaxed);
+	atomic_store_explicit(&cpu->metrics_sequence, sequence + 2, memory_order_release);
+	cpu->metrics_published_at = cpu->metrics.cycles;
+}
+
+static void handle_events(DCPU_State *cpu);
+
+/* Runs a single clock cycle. Anything that needs to happen at a particular cycle, rather than
+ * on every one, is handled by handle_events(), so that it costs a single comparison here.
+*/
+static inline void step_cycle(DCPU_State *cpu)
+{
+	cpu->cycle = cpu->cycle.execute(cpu);
+	cpu->metrics.cycles++;
+	if(++cpu->timer >= cpu->next_event)
+		handle_events(cpu);
+}
+
+static void history_event(DCPU_State *cpu);
+static uint64_t history_next(const DCPU_History *history);
+static uint64_t wheel_next(const Wheel *wheel);
+static void wheel_run(DCPU_State *cpu);
+
+/* Returns the cycle of the next event that the CPU's state must be exact for, which is any but
+ * publishing the counters.
+*/
+static uint64_t events_next(const DCPU_State *cpu)
+{
+	uint64_t	next = cpu->run_end;
+
+	if(cpu->history != NULL && history_next(cpu->history) < next)
+		next = history_next(cpu->history);
+	if(wheel_next(&cpu->wheel) < next)
+		next = wheel_next(&cpu->wheel);
+
+	return next;
+}
+
+/* Works out the cycle at which handle_events() next needs to run. */
+static void schedule_events(DCPU_State *cpu)
+{
+	const uint64_t	unpublished = cpu->metrics.cycles - cpu->metrics_published_at;
+
+	cpu->next_event = events_next(cpu);
+	if(unpublished >= METRICS_INTERVAL)
+		cpu->next_event = cpu->timer;
+	else if(cpu->timer + (METRICS_INTERVAL - unpublished) < cpu->next_event)
+		cpu->next_event = cpu->timer + (METRICS_INTERVAL - unpublished);
+}
+
+/** \brief A loop that copies or fills memory a word at a time, as recognized by loop_match(). */
+typedef struct {
+	unsigned int	dest;				/**< Register pointing at the word to write. */
+	int		source;				/**< Register pointing at the word to copy, or -1 when filling. */
+	const uint16_t	*value;				/**< The value to fill with, or NULL when copying. */
+	unsigned int	counter;			/**< Register counting down the words left. */
+	int		carry;				/**< Register of the ADD that sets O last, or -1 if the SUB does. */
+	unsigned int	updates;			/**< Number of ADD and SUB instructions. */
+	unsigned int	jump;				/**< Length of the SET PC back to the start, in words. */
+	uint16_t	start, test, end;		/**< Addresses of the loop, its IFN, and the instruction after it. */
+} Loop;
+
+/* Recognizes a loop that copies or fills memory at an address: a SET into [dest] from [source],
+ * a register or a short literal, then ADD dest, 1 (and ADD source, 1) and SUB counter, 1 in
+ * any order, then IFN counter, 0 and SET PC back to the start.
+*/
+static int loop_match(const DCPU_State *cpu, uint16_t start, Loop *loop)
+{
+	const uint16_t	*memory = cpu->memory;
+	uint16_t	pc = start, inst = memory[pc++];
+	unsigned int	a = (inst >> 4) & 0x3f, b = inst >> 10, adds = 0, counters = 0, i;
+
+	if(!loop_candidate(inst))
+		return 0;
+	loop->start = start;
+	loop->dest = a - VAL_DEREF_REG_A;
+	loop->source = -1;
+	loop->value = NULL;
+	if(b >= VAL_DEREF_REG_A && b <= VAL_DEREF_REG_J && b - VAL_DEREF_REG_A != loop->dest)
+		loop->source = b - VAL_DEREF_REG_A;
+	else if(b <= VAL_REG_J && b != loop->dest)
+		loop->value = &cpu->registers[b];
+	else if(b >= 0x20)
+		loop->value = literals + (b - 0x20);
+	else
+		return 0;
+	loop->updates = loop->source >= 0 ? 3 : 2;
+	loop->carry = -1;
+	for(i = 0; i < loop->updates; i++)
+	{
+		inst = memory[pc++];
+		a = (inst >> 4) & 0x3f;
+		if(inst >> 10 != 0x21 || a > VAL_REG_J)
+			return 0;
+		if((inst & 0xf) == OP_SUB && counters++ == 0)
+		{
+			loop->counter = a;
+			loop->carry = -1;
+		}
+		else if((inst & 0xf) == OP_ADD && (a == loop->dest || (int) a == loop->source) && (adds & (1u << a)) == 0)
+		{
+			adds |= 1u << a;
+			loop->carry = a;
+		}
+		else
+			return 0;
+	}
+	if(counters != 1 || (adds & (1u << loop->counter)) != 0 || loop->value == &cpu->registers[loop->counter])
+		return 0;
+	loop->test = pc;
+	if(memory[pc++] != (0x20 << 10 | loop->counter << 4 | OP_IFN))
+		return 0;
+	inst = memory[pc++];
+	if(start < 0x20 && inst == ((0x20 + start) << 10 | VAL_PC << 4 | OP_SET))
+		loop->jump = 1;
+	else if(inst == (VAL_SUCC_LIT << 10 | VAL_PC << 4 | OP_SET) && memory[pc++] == start)
+		loop->jump = 2;
+	else
+		return 0;
+	loop->end = pc;
+
+	return 1;
+}
+
+/* Checks that a loop can access a range of memory natively, without anything else needing to
+ * notice: the range doesn't wrap around and has no devices mapped into it, and if it's written,
+ * it holds neither the watched address, the I/O port nor the loop itself.
+*/
+static int loop_range_plain(const DCPU_State *cpu, const Loop *loop, uint16_t address, size_t length, int written)
+{
+	size_t		page;
+	uint16_t	pc;
+
+	if(address + length > MEM_SIZE)
+		return 0;
+	for(page = address / PAGE_SIZE; page <= (address + length - 1) / PAGE_SIZE; page++)
+	{
+		if(cpu->device_pages[page] != 0)
+			return 0;
+	}
+	if(!written)
+		return 1;
+	if(cpu->watch - address < length || cpu->io_port - address < length)
+		return 0;
+	for(pc = loop->start; pc != loop->end; pc++)
+	{
+		if((uint16_t) (pc - address) < length)
+			return 0;
+	}
+	return 1;
+}
+
+/* Runs a loop that copies or fills memory natively, if the CPU has just jumped to one. Every
+ * register, counter and the cycle count end up exactly as if it had been interpreted, so it is
+ * left to the interpreter when anything would need to see it partway through: coverage, a
+ * breakpoint in it, or an event or the end of the current step before it's done. Publishing
+ * the counters doesn't count, and is just done after the loop.
+*/
+static void loop_accelerate(DCPU_State *cpu)
+{
+	uint16_t	*registers = cpu->registers;
+	Loop		loop;
+	size_t		count, i;
+	uint64_t	cycles, instructions;
+	uint16_t	pc;
+
+	if(cpu->coverage != NULL || !loop_match(cpu, cpu->pc, &loop))
+		return;
+	count = registers[loop.counter] != 0 ? registers[loop.counter] : 0x10000;
+	/* Each time around takes a SET, the updates, a taken IFN and the jump back; the last one skips the jump instead. */
+	cycles = (count - 1) * (1 + 2 * loop.updates + 2 + loop.jump) + 1 + 2 * loop.updates + 4;
+	instructions = (count - 1) * (loop.updates + 3) + loop.updates + 2;
+	if(cpu->timer + cycles > cpu->step_end || cpu->timer + cycles >= events_next(cpu))
+		return;
+	if(cpu->breakpoint_count > 0)
+	{
+		for(pc = loop.start; pc != loop.end; pc++)
+		{
+			if(cpu->breakpoints[pc / 32] & (1u << (pc % 32)))
+				return;
+		}
+	}
+	if(!loop_range_plain(cpu, &loop, registers[loop.dest], count, 1))
+		return;
+	if(loop.source >= 0)
+	{
+		uint16_t	*dest = cpu->memory + registers[loop.dest];
+		const uint16_t	*source = cpu->memory + registers[loop.source];
+
+		if(!loop_range_plain(cpu, &loop, registers[loop.source], count, 0))
+			return;
+		/* Copying upwards into the source repeats its start, which memmove() wouldn't do. */
+		if(dest > source && dest < source + count)
+		{
+			for(i = 0; i < count; i++)
+				dest[i] = source[i];
+		}
+		else
+			memmove(dest, source, count * sizeof *dest);
+		registers[loop.source] += count;
+		cpu->metrics.memory_reads += count;
+	}
+	else
+	{
+		uint16_t	*dest = cpu->memory + registers[loop.dest];
+		const uint16_t	value = *loop.value;
+
+		for(i = 0; i < count; i++)
+			dest[i] = value;
+	}
+	memory_stored(cpu, registers[loop.dest], count);
+	registers[loop.dest] += count;
+	registers[loop.counter] = 0;
+	/* The SUB takes the counter from 1 to 0 the last time around, an ADD carries if it wraps to 0. */
+	cpu->o = loop.carry >= 0 && registers[loop.carry] == 0;
+	cpu->pc = loop.end;
+	cpu->inst_pc = loop.test;
+	cpu->timer += cycles;
+	cpu->metrics.cycles += cycles;
+	cpu->metrics.instructions += instructions;
+	cpu->metrics.memory_reads += instructions + (count - 1) * (loop.jump - 1);
+	cpu->metrics.memory_writes += count;
+	cpu->metrics.ifs_taken += count - 1;
+	cpu->metrics.ifs_not_taken++;
+	cpu->metrics.skipped++;
+}
+
+/* Takes a request from DCPU_RequestStop(), if there is one and the CPU is between instructions.
+ * Otherwise a request is looked at again after every cycle, until the instruction is done.
+ * Replaying the history leaves it to whatever runs the CPU next, as that has to reach its target.
+*/
+static int stop_taken(DCPU_State *cpu)
+{
+	if(cpu->replaying || atomic_load_explicit(&cpu->stop_request, memory_order_relaxed) == 0)
+		return 0;
+	if(cpu->inst != 0 || cpu->skip != 0)
+	{
+		cpu->next_event = cpu->timer + 1;
+		return 0;
+	}
+	atomic_store_explicit(&cpu->stop_request, 0, memory_order_relaxed);
+	cpu->stopped = 1;
+	cpu->step_end = cpu->timer;
+
+	return 1;
+}
+
+/* Handles whatever is due at the current cycle. */
+static void handle_events(DCPU_State *cpu)
+{
+	if(wheel_next(&cpu->wheel) <= cpu->timer)
+		wheel_run(cpu);
+	if(cpu->history != NULL && cpu->timer >= history_next(cpu->history))
+		history_event(cpu);
+	if(cpu->looped)
+	{
+		cpu->stop = cpu->memory[cpu->inst_pc] == DCPU_STOP ? DCPU_RUN_HALTED : DCPU_RUN_STUCK;
+		cpu->looped = 0;
+	}
+	if(cpu->io_waiting)
+		cpu->stop = DCPU_RUN_WAIT_IO;
+	if(cpu->timer >= cpu->run_end && cpu->stop == 0)
+		cpu->stop = DCPU_RUN_BUDGET;
+	if(cpu->metrics.cycles - cpu->metrics_published_at >= METRICS_INTERVAL)
+		metrics_publish(cpu);
+	schedule_events(cpu);
+	if(stop_taken(cpu) && (cpu->stop == 0 || cpu->stop == DCPU_RUN_BUDGET))
+		cpu->stop = DCPU_RUN_STOPPED;
+	if(cpu->loop_entered)
+	{
+		cpu->loop_entered = 0;
+		if(cpu->stop == 0 && cpu->inst == 0 && cpu->skip == 0)
+			loop_accelerate(cpu);
+	}
+}
+
 /** \brief Execute a fixed number of instructions.
  *
  * This function runs the emulated DCPU-16 for a given number of instruction cycles.
@@ -678,8 +1430,13 @@ uint16_t DCPU_GetMemory(const DCPU_State *cpu, uint16_t address)
 */
 void DCPU_StepCycles(DCPU_State *cpu, size_t num_cycles)
 {
-	for(; num_cycles != 0; --num_cycles)
-		cpu->cycle = cpu->cycle.execute(cpu);
+	cpu->stopped = 0;
+	cpu->step_end = cpu->timer + num_cycles;
+	stop_taken(cpu);
+	while(cpu->timer < cpu->step_end)
+		step_cycle(cpu);
+	cpu->step_end = 0;
+	metrics_publish(cpu);
 }
 
 /** \brief Execute a single whole instruction.
@@ -692,14 +1449,16 @@ void DCPU_StepCycles(DCPU_State *cpu, size_t num_cycles)
 */
 size_t DCPU_StepInstruction(DCPU_State *cpu)
 {
-	size_t	num_cycles = 0;
+	const uint64_t	start = cpu->timer;
 
+	cpu->stopped = 0;
+	if(stop_taken(cpu))
+		return 0;
 	do {
-		cpu->cycle = cpu->cycle.execute(cpu);
-		++num_cycles;
+		step_cycle(cpu);
 	} while(cpu->inst != 0 || cpu->skip != 0);
 
-	return num_cycles;
+	return cpu->timer - start;
 }
 
 /** \brief Execute until the CPU seems "stuck".
@@ -711,7 +1470,8 @@ size_t DCPU_StepInstruction(DCPU_State *cpu)
  * to ever exit the loop.
  *
  * It's of course possible to come up with any number of n-instruction infinite
- * loops that will \em not be detected by this function, so beware.
+ * loops that will \em not be detected by this function, so beware. Use
+ * DCPU_StepUntilRepeat() to detect those.
  * 
  * Note that it's possible for this to never return, since there is no guarantee
  * that the DCPU-16 will end up in a stuck state as defined by the above.
@@ -723,15 +1483,3413 @@ size_t DCPU_StepUntilStuck(DCPU_State *cpu)
 	size_t	num_cycles = 0;
 	int	stuck;
 
+	cpu->step_end = UINT64_MAX;
 	do {
 		const uint16_t	old_pc = cpu->pc;
 		num_cycles += DCPU_StepInstruction(cpu);
-		stuck = cpu->pc == old_pc;
-	} while(!stuck);
+		stuck = !cpu->stopped && cpu->pc == old_pc;
+	} while(!stuck && !cpu->stopped);
+	cpu->step_end = 0;
+	cpu->metrics.stuck += stuck;
+	metrics_publish(cpu);
 
 	return num_cycles;
 }
 
+static int native_ready(DCPU_State *cpu, const DCPU_NativeModule *module, uint16_t pc, uint64_t timer);
+static void native_run(DCPU_State *cpu, const DCPU_NativeModule *module);
+
+/* Runs until something needs the host's attention, using natively compiled blocks where the
+ * module has them, if there is one.
+*/
+static DCPU_RunStatus run(DCPU_State *cpu, const DCPU_NativeModule *module, size_t budget, size_t *num_cycles)
+{
+	const uint64_t	start = cpu->timer;
+	DCPU_RunStatus	status;
+
+	cpu->stop = cpu->io_waiting ? DCPU_RUN_WAIT_IO : budget == 0 ? DCPU_RUN_BUDGET : 0;
+	cpu->run_end = start + budget;
+	cpu->step_end = UINT64_MAX;
+	cpu->stopped = 0;
+	schedule_events(cpu);
+	if(cpu->stop == 0 && stop_taken(cpu))
+		cpu->stop = DCPU_RUN_STOPPED;
+	if(cpu->breakpoint_count != 0)
+	{
+		while(cpu->stop == 0)
+		{
+			step_cycle(cpu);
+			if(cpu->stop == 0 && cpu->inst == 0 && cpu->skip == 0 && (cpu->breakpoints[cpu->pc / 32] & (1u << (cpu->pc % 32))))
+				cpu->stop = DCPU_RUN_BREAKPOINT;
+		}
+	}
+	else if(module != NULL && cpu->coverage == NULL)
+	{
+		while(cpu->stop == 0)
+		{
+			if(cpu->inst == 0 && cpu->skip == 0 && native_ready(cpu, module, cpu->pc, cpu->timer))
+				native_run(cpu, module);
+			else
+				step_cycle(cpu);
+		}
+	}
+	else
+	{
+		while(cpu->stop == 0)
+			step_cycle(cpu);
+	}
+	status = cpu->stop;
+	cpu->stop = 0;
+	cpu->run_end = UINT64_MAX;
+	cpu->step_end = 0;
+	schedule_events(cpu);
+	if(status == DCPU_RUN_STUCK || status == DCPU_RUN_HALTED)
+		cpu->metrics.stuck++;
+	metrics_publish(cpu);
+	if(num_cycles != NULL)
+		*num_cycles = cpu->timer - start;
+
+	return status;
+}
+
+/** \brief Run until something needs the host's attention, or a cycle budget runs out.
+ *
+ * This is meant for hosts that run many guests from an event loop, a slice at a time.
+ * It returns, with the reason in the status, when:
+ * - the budget runs out, even in the middle of an instruction,
+ * - the guest writes to the I/O port set with DCPU_SetIOPort(),
+ * - the next instruction to execute is at a breakpoint set with DCPU_SetBreakpoint(),
+ * - an instruction jumps to itself, which is \c DCPU_RUN_HALTED if it's DCPU_STOP, and
+ *   \c DCPU_RUN_STUCK otherwise,
+ * - DCPU_RequestStop() has been called, which stops it between instructions.
+ *
+ * All state is kept in the instance, so calling this again continues exactly where it
+ * stopped. It doesn't stop at a breakpoint it was called at, so that it can be resumed.
+ * While the guest waits for I/O, this returns \c DCPU_RUN_WAIT_IO without running.
+ *
+ * \param budget The maximum number of clock cycles to run.
+ * \param num_cycles If not \c NULL, set to the number of clock cycles run.
+ *
+ * \return The reason for returning.
+*/
+DCPU_RunStatus DCPU_Run(DCPU_State *cpu, size_t budget, size_t *num_cycles)
+{
+	return run(cpu, NULL, budget, num_cycles);
+}
+
+/** \brief Sets or clears a breakpoint for DCPU_Run().
+ *
+ * \param address The address of the instruction to stop at.
+ * \param enabled Non-zero to set the breakpoint, zero to clear it.
+*/
+void DCPU_SetBreakpoint(DCPU_State *cpu, uint16_t address, int enabled)
+{
+	const uint32_t	bit = 1u << (address % 32);
+
+	if(!(cpu->breakpoints[address / 32] & bit) == !enabled)
+		return;
+	cpu->breakpoints[address / 32] ^= bit;
+	cpu->breakpoint_count += enabled ? 1 : -1;
+}
+
+/** \brief Sets the address of the guest's I/O port.
+ *
+ * The guest makes an I/O request by writing a value to the port, for instance the address
+ * of a block describing the request. DCPU_Run() then returns \c DCPU_RUN_WAIT_IO, and won't
+ * run the guest again until the host calls DCPU_CompleteIO(). Other ways of running the
+ * CPU don't wait.
+ *
+ * \param address The address of the port, or 0 to disconnect it.
+*/
+void DCPU_SetIOPort(DCPU_State *cpu, uint16_t address)
+{
+	cpu->io_port = address != 0 ? address : MEM_SIZE;
+}
+
+/** \brief Returns the value the guest wrote to the I/O port to make its latest request. */
+uint16_t DCPU_GetIORequest(const DCPU_State *cpu)
+{
+	return cpu->io_request;
+}
+
+/** \brief Completes the guest's I/O request, so that it runs again.
+ *
+ * \param result A value to store in the I/O port, for the guest to read.
+*/
+void DCPU_CompleteIO(DCPU_State *cpu, uint16_t result)
+{
+	cpu->io_waiting = 0;
+	if(cpu->io_port < MEM_SIZE)
+	{
+		cpu->memory[cpu->io_port] = result;
+		memory_changed(cpu, cpu->io_port, 1);
+	}
+}
+
+/** \brief Asks the CPU to stop, from any thread.
+ *
+ * Whichever of DCPU_Run() and the DCPU_Step functions is running the CPU returns as soon as
+ * the current instruction is done, or the next one to be called does if none is running.
+ * DCPU_Run() then returns \c DCPU_RUN_STOPPED, unless it stops for another reason at the
+ * same time.
+ *
+ * To keep it off the path of every cycle, the request is looked for whenever the guest jumps
+ * or calls backwards, or wraps around from the end of memory to the start. Every loop does one
+ * of those, so the request is seen within one time around it.
+ *
+ * Stepping back doesn't stop for a request, nor take it, since it replays the history up to
+ * the cycle it was asked for. The request is left to whatever runs the CPU next.
+*/
+void DCPU_RequestStop(DCPU_State *cpu)
+{
+	atomic_store_explicit(&cpu->stop_request, 1, memory_order_relaxed);
+}
+
+/** \brief Returns whether the latest call running the CPU stopped because of DCPU_RequestStop(). */
+int DCPU_WasStopped(const DCPU_State *cpu)
+{
+	return cpu->stopped;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/** \brief Read out the operational counters of an instance.
+ *
+ * The counters are kept per instance, and published for other threads to read
+ * whenever DCPU_Run() or one of the DCPU_Step functions returns, and every 16384
+ * cycles while one is running, or after a copy or fill loop run in one go that
+ * crosses that point. This can be called from any thread without locking, and
+ * always returns a consistent set of counters.
+ *
+ * \param metrics Receives the counters.
+*/
+void DCPU_GetMetrics(const DCPU_State *cpu, DCPU_Metrics *metrics)
+{
+	uint64_t	*counters = (uint64_t *) metrics;
+	unsigned int	before, after;
+	size_t		i;
+
+	do {
+		while((before = atomic_load_explicit(&cpu->metrics_sequence, memory_order_acquire)) & 1)
+			;
+		for(i = 0; i < METRICS_COUNT; i++)
+			counters[i] = atomic_load_explicit(&cpu->published[i], memory_order_relaxed);
+		atomic_thread_fence(memory_order_acquire);
+		after = atomic_load_explicit(&cpu->metrics_sequence, memory_order_relaxed);
+	} while(before != after);
+}
+
+/** \brief Names and descriptions of the counters, in the order they appear in DCPU_Metrics. */
+static const struct {
+	const char	*name;
+	const char	*help;
+} metrics_info[] = {
+	{ "cycles_total", "Clock cycles executed." },
+	{ "instructions_total", "Instructions fetched." },
+	{ "skipped_total", "Instructions skipped by IFx." },
+	{ "ifs_taken_total", "IFx instructions whose condition held." },
+	{ "ifs_not_taken_total", "IFx instructions whose condition failed." },
+	{ "divmods_total", "DIV and MOD instructions executed." },
+	{ "memory_reads_total", "Words read from memory, including instruction words." },
+	{ "memory_writes_total", "Words written to memory." },
+	{ "stuck_total", "Times the CPU was found to be stuck." }
+};
+
+/** \brief Write the counters of a whole fleet of instances, in a plain text exposition format.
+ *
+ * For each counter, this writes \c HELP and \c TYPE comment lines followed by one line per
+ * instance, labelled with the instance's index in \p cpus. This is the text format that
+ * Prometheus and compatible monitoring systems scrape. It is safe to call from any thread.
+ *
+ * \param out The stream to write to.
+ * \param cpus The instances. Entries that are \c NULL are skipped.
+ * \param count The number of entries in \p cpus.
+ *
+ * \return 1 on success, 0 on failure.
+*/
+int DCPU_WriteMetrics(FILE *out, const DCPU_State * const *cpus, size_t count)
+{
+	DCPU_Metrics	*snapshots;
+	size_t		i, j;
+
+	if(count > 0 && (snapshots = malloc(count * sizeof *snapshots)) == NULL)
+		return 0;
+	for(j = 0; j < count; j++)
+	{
+		if(cpus[j] != NULL)
+			DCPU_GetMetrics(cpus[j], &snapshots[j]);
+	}
+	for(i = 0; i < sizeof metrics_info / sizeof *metrics_info; i++)
+	{
+		fprintf(out, "# HELP cade_%s %s\n", metrics_info[i].name, metrics_info[i].help);
+		fprintf(out, "# TYPE cade_%s counter\n", metrics_info[i].name);
+		for(j = 0; j < count; j++)
+		{
+			if(cpus[j] != NULL)
+				fprintf(out, "cade_%s{cpu=\"%zu\"} %" PRIu64 "\n", metrics_info[i].name, j, ((const uint64_t *) &snapshots[j])[i]);
+		}
+	}
+	if(count > 0)
+		free(snapshots);
+
+	return !ferror(out);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Computes the digest of one page of memory. */
+static uint64_t page_digest(const uint16_t *memory, size_t page)
+{
+	uint64_t	digest = 0;
+	size_t		address;
+
+	for(address = page * PAGE_SIZE; address < (page + 1) * PAGE_SIZE; address++)
+		digest ^= hash_word(address, memory[address]);
+
+	return digest;
+}
+
+/* Recomputes the digests of any pages that have been marked as stale. */
+static void refresh_hashes(DCPU_State *cpu)
+{
+	size_t	i;
+
+	for(i = 0; i < sizeof cpu->hash_stale / sizeof *cpu->hash_stale; i++)
+	{
+		while(cpu->hash_stale[i] != 0)
+		{
+			const unsigned int	bit = __builtin_ctz(cpu->hash_stale[i]);
+			const size_t		page = 32 * i + bit;
+			const uint64_t		digest = page_digest(cpu->memory, page);
+
+			cpu->memory_hash ^= cpu->page_hash[page] ^ digest;
+			cpu->page_hash[page] = digest;
+			cpu->hash_stale[i] &= ~(1u << bit);
+		}
+	}
+}
+
+/** \brief Returns a hash of the entire state of the emulated DCPU-16.
+ *
+ * The hash covers memory, registers and any partially executed instruction, but not
+ * the cycle counter, so two instances that will behave identically from here on hash
+ * to the same value. It does not depend on the host, or on where the instances live
+ * in host memory, so it can be used to find equivalent states across processes.
+ *
+ * Digests of memory are maintained page by page as the CPU writes it, so this does
+ * not have to look at all of memory. Memory replaced wholesale, for instance by
+ * DCPU_Load(), is rehashed on the next call.
+ *
+ * \return The hash.
+*/
+uint64_t DCPU_GetStateHash(DCPU_State *cpu)
+{
+	const uint16_t	words[] = { cpu->sp, cpu->pc, cpu->o, cpu->inst, cpu->dummy, cpu->skip, thunk_index(cpu->cycle) };
+	uint64_t	hash;
+	size_t		i;
+
+	refresh_hashes(cpu);
+	hash = cpu->memory_hash;
+	for(i = 0; i < DCPU_REG_COUNT; i++)
+		hash = hash_mix(hash ^ cpu->registers[i]) + i;
+	for(i = 0; i < sizeof words / sizeof *words; i++)
+		hash = hash_mix(hash ^ words[i]) + i;
+	hash = hash_mix(hash ^ value_ref(cpu, cpu->val_a));
+	hash = hash_mix(hash ^ value_ref(cpu, cpu->val_b));
+
+	return hash;
+}
+
+/* Compares the states of two instances exactly, in the same terms as DCPU_GetStateHash(). */
+static int state_equal(const DCPU_State *a, const DCPU_State *b)
+{
+	return memcmp(a->registers, b->registers, sizeof a->registers) == 0 &&
+		a->sp == b->sp && a->pc == b->pc && a->o == b->o && a->inst == b->inst &&
+		a->dummy == b->dummy && a->skip == b->skip && a->cycle.execute == b->cycle.execute &&
+		value_ref(a, a->val_a) == value_ref(b, b->val_a) && value_ref(a, a->val_b) == value_ref(b, b->val_b) &&
+		memcmp(a->memory, b->memory, sizeof a->memory) == 0;
+}
+
+/** \brief Execute until the CPU repeats a previous state.
+ *
+ * Runs the emulated DCPU-16 until it reaches a state, at an instruction boundary,
+ * that is exactly the same as one it has been in before. Since the DCPU-16 is
+ * deterministic, that means it's in an infinite loop, of any length.
+ *
+ * States are compared using DCPU_GetStateHash(), and Brent's cycle detection
+ * algorithm, so only a single earlier state is kept around. A matching hash is
+ * confirmed by comparing the states in full, before a repeat is reported.
+ *
+ * \param max_cycles The maximum number of cycles to run, or 0 for no limit. Note that without
+ *        a limit this might take practically forever, since loops can be very long.
+ * \param period If not \c NULL, set to the length of the loop in clock cycles, or 0 if no
+ *        repeat was found before \p max_cycles ran out.
+ *
+ * \return The number of clock cycles spent.
+*/
+size_t DCPU_StepUntilRepeat(DCPU_State *cpu, size_t max_cycles, size_t *period)
+{
+	DCPU_State	*saved;
+	uint64_t	saved_hash;
+	size_t		num_cycles = 0, saved_cycles = 0, power = 1, length = 0;
+
+	if(period != NULL)
+		*period = 0;
+	if((saved = malloc(sizeof *saved)) == NULL)
+		return 0;
+	memcpy(saved->memory, cpu->memory, sizeof cpu->memory);
+	copy_registers(saved, cpu);
+	saved_hash = DCPU_GetStateHash(cpu);
+
+	while(max_cycles == 0 || num_cycles < max_cycles)
+	{
+		uint64_t	hash;
+
+		num_cycles += DCPU_StepInstruction(cpu);
+		if(cpu->stopped)
+			break;
+		length++;
+		if((hash = DCPU_GetStateHash(cpu)) == saved_hash && state_equal(cpu, saved))
+		{
+			if(period != NULL)
+				*period = num_cycles - saved_cycles;
+			cpu->metrics.stuck++;
+			break;
+		}
+		if(length == power)
+		{
+			memcpy(saved->memory, cpu->memory, sizeof cpu->memory);
+			copy_registers(saved, cpu);
+			saved_hash = hash;
+			saved_cycles = num_cycles;
+			power *= 2;
+			length = 0;
+		}
+	}
+	free(saved);
+	metrics_publish(cpu);
+
+	return num_cycles;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/** \brief State of an in-process, coverage-guided fuzzer for guest programs. */
+struct DCPU_Fuzzer {
+	DCPU_State	*cpu;				/**< The instance inputs are run on. */
+	DCPU_State	*base;				/**< Pristine state every run starts from. */
+	uint16_t	input_address;			/**< Where inputs are loaded in guest memory. */
+	size_t		input_length;			/**< Length of every input, in words. */
+	size_t		max_cycles;			/**< Cycle budget for a single run. */
+	uint32_t	random;				/**< State of the mutator's random number generator. */
+	size_t		edges;				/**< Number of distinct edges seen so far. */
+	uint16_t	*corpus;			/**< Inputs kept so far, input_length words each. */
+	size_t		corpus_size, corpus_alloc;	/**< Number of inputs in, and allocated for, the corpus. */
+	uint16_t	*scratch;			/**< Input being mutated. */
+	uint8_t		trace[DCPU_COVERAGE_SIZE];	/**< Coverage map of the current run. */
+	uint8_t		seen[DCPU_COVERAGE_SIZE];	/**< Union of the coverage of all runs. */
+};
+
+/* Restores all pages written since the last restore from the given instance, and its registers. */
+static void restore_dirty(DCPU_State *cpu, const DCPU_State *base)
+{
+	size_t	i;
+
+	for(i = 0; i < sizeof cpu->dirty / sizeof *cpu->dirty; i++)
+	{
+		while(cpu->dirty[i] != 0)
+		{
+			const unsigned int	bit = __builtin_ctz(cpu->dirty[i]);
+			const size_t		page = 32 * i + bit;
+
+			memcpy(cpu->memory + page * PAGE_SIZE, base->memory + page * PAGE_SIZE, PAGE_SIZE * sizeof *cpu->memory);
+			cpu->hash_stale[i] |= 1u << bit;
+			cpu->dirty[i] &= ~(1u << bit);
+		}
+	}
+	copy_registers(cpu, base);
+}
+
+/* Runs one input from the base state, and returns the number of edges never seen before. */
+static size_t fuzz_execute(DCPU_Fuzzer *fuzzer, const uint16_t *input)
+{
+	DCPU_State	*cpu = fuzzer->cpu;
+	const uint64_t	*trace = (const uint64_t *) fuzzer->trace;
+	size_t		cycles = 0, fresh = 0, i, j;
+
+	restore_dirty(cpu, fuzzer->base);
+	DCPU_Load(cpu, fuzzer->input_address, input, fuzzer->input_length);
+	memset(fuzzer->trace, 0, sizeof fuzzer->trace);
+
+	while(cycles < fuzzer->max_cycles)
+	{
+		const uint16_t	old_pc = cpu->pc;
+
+		cycles += DCPU_StepInstruction(cpu);
+		if(cpu->pc == old_pc)
+			break;
+	}
+
+	/* Most of the map is untouched by any single run, so scan it a word at a time. */
+	for(i = 0; i < sizeof fuzzer->trace / sizeof *trace; i++)
+	{
+		if(trace[i] == 0)
+			continue;
+		for(j = i * sizeof *trace; j < (i + 1) * sizeof *trace; j++)
+		{
+			if(fuzzer->trace[j] != 0 && fuzzer->seen[j] == 0)
+			{
+				fuzzer->seen[j] = 1;
+				fresh++;
+			}
+		}
+	}
+	fuzzer->edges += fresh;
+
+	return fresh;
+}
+
+/* Appends an input to the corpus. */
+static int fuzz_keep(DCPU_Fuzzer *fuzzer, const uint16_t *input)
+{
+	if(fuzzer->corpus_size == fuzzer->corpus_alloc)
+	{
+		const size_t	alloc = fuzzer->corpus_alloc ? 2 * fuzzer->corpus_alloc : 16;
+		uint16_t	*corpus;
+
+		if((corpus = realloc(fuzzer->corpus, alloc * fuzzer->input_length * sizeof *corpus)) == NULL)
+			return 0;
+		fuzzer->corpus = corpus;
+		fuzzer->corpus_alloc = alloc;
+	}
+	memcpy(fuzzer->corpus + fuzzer->corpus_size++ * fuzzer->input_length, input, fuzzer->input_length * sizeof *input);
+
+	return 1;
+}
+
+static uint32_t fuzz_random(DCPU_Fuzzer *fuzzer)
+{
+	uint32_t	x = fuzzer->random;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return fuzzer->random = x;
+}
+
+/* Applies a few random mutations to the scratch input. */
+static void fuzz_mutate(DCPU_Fuzzer *fuzzer)
+{
+	static const uint16_t	interesting[] = { 0x0000, 0x0001, 0x001f, 0x0020, 0x00ff, 0x0100, 0x7fff, 0x8000, 0xfffe, 0xffff };
+	uint16_t		*input = fuzzer->scratch;
+	const size_t		length = fuzzer->input_length;
+	unsigned int		count = 1 + fuzz_random(fuzzer) % 4;
+
+	for(; count > 0; --count)
+	{
+		const size_t	pos = fuzz_random(fuzzer) % length;
+
+		switch(fuzz_random(fuzzer) % 6)
+		{
+		case 0:
+			input[pos] ^= 1u << (fuzz_random(fuzzer) % 16);
+			break;
+		case 1:
+			input[pos] = fuzz_random(fuzzer);
+			break;
+		case 2:
+			input[pos] = interesting[fuzz_random(fuzzer) % (sizeof interesting / sizeof *interesting)];
+			break;
+		case 3:
+			input[pos] += 1 + fuzz_random(fuzzer) % 16;
+			break;
+		case 4:
+			input[pos] -= 1 + fuzz_random(fuzzer) % 16;
+			break;
+		case 5:
+			{
+				/* Splice in the tail of some other input from the corpus. */
+				const uint16_t	*other = fuzzer->corpus + (fuzz_random(fuzzer) % fuzzer->corpus_size) * length;
+
+				memcpy(input + pos, other + pos, (length - pos) * sizeof *input);
+			}
+			break;
+		}
+	}
+}
+
+/** \brief Creates a coverage-guided fuzzer for a guest program.
+ *
+ * The fuzzer takes a private copy of the given instance, which should have the
+ * program loaded and be ready to run. Every input is then run from that state by
+ * loading it at \p input_address, and running until the CPU gets stuck or the cycle
+ * budget runs out. Between runs, only the memory pages that the previous run wrote
+ * are restored, rather than re-initializing all of memory.
+ *
+ * Control flow edges are recorded at every taken <tt>SET PC</tt>, \c JSR and skip
+ * caused by an \c IFx instruction, and inputs that reach edges never seen before
+ * are kept in a corpus that is used as the basis for further mutation.
+ *
+ * \param cpu The instance to fuzz, which is copied and not modified.
+ * \param input_address The address where inputs are loaded.
+ * \param input_length The length of every input, in words.
+ * \param max_cycles The maximum number of cycles to spend running a single input.
+ *
+ * \return The new fuzzer, or \c NULL on failure. Destroy it with DCPU_FuzzerDestroy().
+*/
+DCPU_Fuzzer * DCPU_FuzzerCreate(const DCPU_State *cpu, uint16_t input_address, size_t input_length, size_t max_cycles)
+{
+	DCPU_Fuzzer	*fuzzer;
+
+	if(cpu == NULL || input_length == 0 || input_address + input_length > MEM_SIZE)
+		return NULL;
+	if((fuzzer = calloc(1, sizeof *fuzzer)) != NULL)
+	{
+		fuzzer->input_address = input_address;
+		fuzzer->input_length = input_length;
+		fuzzer->max_cycles = max_cycles;
+		fuzzer->random = 0x2545f491;
+		fuzzer->cpu = DCPU_Create();
+		fuzzer->base = DCPU_Create();
+		fuzzer->scratch = calloc(input_length, sizeof *fuzzer->scratch);
+		if(fuzzer->cpu != NULL && fuzzer->base != NULL && fuzzer->scratch != NULL)
+		{
+			memcpy(fuzzer->base->memory, cpu->memory, sizeof cpu->memory);
+			copy_registers(fuzzer->base, cpu);
+			memcpy(fuzzer->cpu->memory, cpu->memory, sizeof cpu->memory);
+			copy_registers(fuzzer->cpu, cpu);
+			fuzzer->cpu->coverage = fuzzer->trace;
+			return fuzzer;
+		}
+		DCPU_FuzzerDestroy(fuzzer);
+	}
+	return NULL;
+}
+
+/** \brief Destroys a fuzzer, including its corpus. */
+void DCPU_FuzzerDestroy(DCPU_Fuzzer *fuzzer)
+{
+	if(fuzzer == NULL)
+		return;
+	DCPU_Destroy(fuzzer->cpu);
+	DCPU_Destroy(fuzzer->base);
+	free(fuzzer->scratch);
+	free(fuzzer->corpus);
+	free(fuzzer);
+}
+
+/** \brief Runs a seed input, and adds it to the corpus if it reaches any new edges.
+ *
+ * \param input The input. If shorter than the fuzzer's input length, it is padded with zeroes.
+ * \param length The length of the input, in words.
+ *
+ * \return The number of new edges the input reached.
+*/
+size_t DCPU_FuzzerAddSeed(DCPU_Fuzzer *fuzzer, const uint16_t *input, size_t length)
+{
+	size_t	fresh;
+
+	if(length > fuzzer->input_length)
+		length = fuzzer->input_length;
+	memset(fuzzer->scratch, 0, fuzzer->input_length * sizeof *fuzzer->scratch);
+	memcpy(fuzzer->scratch, input, length * sizeof *input);
+	if((fresh = fuzz_execute(fuzzer, fuzzer->scratch)) > 0 || fuzzer->corpus_size == 0)
+		fuzz_keep(fuzzer, fuzzer->scratch);
+
+	return fresh;
+}
+
+/** \brief Runs the mutation loop for a number of iterations.
+ *
+ * Each iteration picks an input from the corpus, mutates it, and runs it. Inputs
+ * that reach new edges are added to the corpus. If the corpus is empty, an all-zero
+ * input is used as the seed.
+ *
+ * \param iterations The number of mutated inputs to run.
+ *
+ * \return The number of inputs added to the corpus, which is 0 if the corpus is
+ *         empty and the seed couldn't be added to it.
+*/
+size_t DCPU_FuzzerRun(DCPU_Fuzzer *fuzzer, size_t iterations)
+{
+	const size_t	old_size = fuzzer->corpus_size;
+
+	if(fuzzer->corpus_size == 0)
+		DCPU_FuzzerAddSeed(fuzzer, fuzzer->scratch, 0);
+	/* Adding the seed fails only when the corpus can't grow, and there's nothing to mutate then. */
+	if(fuzzer->corpus_size == 0)
+		return 0;
+	for(; iterations > 0; --iterations)
+	{
+		const uint16_t	*parent = fuzzer->corpus + (fuzz_random(fuzzer) % fuzzer->corpus_size) * fuzzer->input_length;
+
+		memcpy(fuzzer->scratch, parent, fuzzer->input_length * sizeof *parent);
+		fuzz_mutate(fuzzer);
+		if(fuzz_execute(fuzzer, fuzzer->scratch) > 0 && !fuzz_keep(fuzzer, fuzzer->scratch))
+			break;
+	}
+	return fuzzer->corpus_size - old_size;
+}
+
+/** \brief Returns the number of inputs in the fuzzer's corpus. */
+size_t DCPU_FuzzerGetCorpusSize(const DCPU_Fuzzer *fuzzer)
+{
+	return fuzzer != NULL ? fuzzer->corpus_size : 0;
+}
+
+/** \brief Returns one of the inputs in the fuzzer's corpus.
+ *
+ * \param index The index of the input, less than DCPU_FuzzerGetCorpusSize().
+ *
+ * \return The input, which is as long as the fuzzer's input length, or \c NULL if \p index is out of range.
+*/
+const uint16_t * DCPU_FuzzerGetInput(const DCPU_Fuzzer *fuzzer, size_t index)
+{
+	if(fuzzer == NULL || index >= fuzzer->corpus_size)
+		return NULL;
+	return fuzzer->corpus + index * fuzzer->input_length;
+}
+
+/** \brief Returns the number of distinct edges reached by all inputs run so far. */
+size_t DCPU_FuzzerGetEdgeCount(const DCPU_Fuzzer *fuzzer)
+{
+	return fuzzer != NULL ? fuzzer->edges : 0;
+}
+
+/** \brief Returns the accumulated coverage map of all inputs run so far.
+ *
+ * \return A map of DCPU_COVERAGE_SIZE bytes, non-zero for every edge reached.
+*/
+const uint8_t * DCPU_FuzzerGetCoverage(const DCPU_Fuzzer *fuzzer)
+{
+	return fuzzer != NULL ? fuzzer->seen : NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/** \brief State of a LEM1802-style text display.
+ *
+ * The display doesn't keep a copy of video memory, it reads the guest's memory
+ * when rendering. What it does keep is a bitmap of cells that have changed since
+ * they were last rendered, maintained as the CPU writes memory.
+*/
+struct DCPU_Display {
+	DCPU_State	*cpu;				/**< The instance whose memory is displayed. */
+	uint16_t	video;				/**< Address of video memory, or 0 if disconnected. */
+	uint16_t	font;				/**< Address of the font, or 0 for the built-in one. */
+	uint16_t	palette;			/**< Address of the palette, or 0 for the built-in one. */
+	uint32_t	dirty[DCPU_DISPLAY_CELLS / 32];	/**< Bitmap of cells that need to be rendered. */
+	int		any_dirty;			/**< Set if any bit in dirty is. */
+	int		blink;				/**< Whether blinking cells were visible in the last frame. */
+};
+
+/* The built-in font, two words per glyph and one byte per column, with the top row in the least
+ * significant bit. Glyphs are 3 by 5 pixels, except for descenders, leaving a blank column
+ * to the right for spacing.
+*/
+static const uint16_t	display_font[256] = {
+	0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+	0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+	0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+	0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+	0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+	0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+	0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+	0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
+	0x0000, 0x0000, 0x002e, 0x0000, 0x0600, 0x0600, 0x3e14, 0x3e00,
+	0x243e, 0x1200, 0x3208, 0x2600, 0x142a, 0x3400, 0x0006, 0x0000,
+	0x001c, 0x2200, 0x221c, 0x0000, 0x1408, 0x1400, 0x081c, 0x0800,
+	0x2010, 0x0000, 0x0808, 0x0800, 0x0020, 0x0000, 0x3008, 0x0600,
+	0x3e22, 0x3e00, 0x243e, 0x2000, 0x322a, 0x2400, 0x222a, 0x1400,
+	0x0e08, 0x3e00, 0x2e2a, 0x1200, 0x3c2a, 0x3a00, 0x320a, 0x0600,
+	0x3e2a, 0x3e00, 0x2e2a, 0x1e00, 0x0014, 0x0000, 0x2014, 0x0000,
+	0x0814, 0x2200, 0x1414, 0x1400, 0x2214, 0x0800, 0x022a, 0x0600,
+	0x1c2a, 0x2c00, 0x3c0a, 0x3c00, 0x3e2a, 0x1400, 0x1c22, 0x2200,
+	0x3e22, 0x1c00, 0x3e2a, 0x2a00, 0x3e0a, 0x0a00, 0x1c22, 0x3a00,
+	0x3e08, 0x3e00, 0x223e, 0x2200, 0x1020, 0x1e00, 0x3e08, 0x3600,
+	0x3e20, 0x2000, 0x3e0c, 0x3e00, 0x3e1c, 0x3e00, 0x1c22, 0x1c00,
+	0x3e0a, 0x0400, 0x1c32, 0x3c00, 0x3e0a, 0x3400, 0x242a, 0x1200,
+	0x023e, 0x0200, 0x3e20, 0x3e00, 0x0e30, 0x0e00, 0x3e18, 0x3e00,
+	0x3608, 0x3600, 0x0638, 0x0600, 0x322a, 0x2600, 0x3e22, 0x0000,
+	0x0608, 0x3000, 0x0022, 0x3e00, 0x0402, 0x0400, 0x2020, 0x2000,
+	0x0204, 0x0000, 0x342c, 0x3800, 0x3e24, 0x1800, 0x1824, 0x2400,
+	0x1824, 0x3e00, 0x1834, 0x2c00, 0x083c, 0x0a00, 0x4854, 0x3c00,
+	0x3e04, 0x3800, 0x003a, 0x0000, 0x2040, 0x3a00, 0x3e18, 0x2400,
+	0x223e, 0x2000, 0x3c1c, 0x3c00, 0x3c04, 0x3800, 0x1824, 0x1800,
+	0x7c24, 0x1800, 0x1824, 0x7c00, 0x3804, 0x0400, 0x283c, 0x1400,
+	0x043e, 0x2400, 0x1c20, 0x3c00, 0x1c30, 0x1c00, 0x3c38, 0x3c00,
+	0x2418, 0x2400, 0x4c50, 0x3c00, 0x343c, 0x2c00, 0x0836, 0x2200,
+	0x0036, 0x0000, 0x2236, 0x0800, 0x0406, 0x0200, 0x0000, 0x0000
+
+};
+
+/* The built-in palette, in the display's 0x0RGB format. */
+static const uint16_t	display_palette[16] = {
+	0x0000, 0x000a, 0x00a0, 0x00aa, 0x0a00, 0x0a0a, 0x0a50, 0x0aaa,
+	0x0555, 0x055f, 0x05f5, 0x05ff, 0x0f55, 0x0f5f, 0x0ff5, 0x0fff
+};
+
+static void display_mark(DCPU_Display *display, unsigned int cell)
+{
+	display->dirty[cell / 32] |= 1u << (cell % 32);
+	display->any_dirty = 1;
+}
+
+static void display_mark_all(DCPU_Display *display)
+{
+	memset(display->dirty, 0xff, sizeof display->dirty);
+	display->any_dirty = 1;
+}
+
+/* Marks all cells showing a glyph, or using a color, as dirty. */
+static void display_mark_matching(DCPU_Display *display, int glyph, int color)
+{
+	const uint16_t	*video = display->cpu->memory;
+	unsigned int	i;
+
+	for(i = 0; i < DCPU_DISPLAY_CELLS; i++)
+	{
+		const uint16_t	cell = video[(uint16_t) (display->video + i)];
+
+		if((cell & 0x7f) == glyph || (cell >> 12) == color || ((cell >> 8) & 0xf) == color)
+			display_mark(display, i);
+	}
+}
+
+/* Tracks a word written by the CPU. Only called with writes that hit memory. */
+static void display_written(DCPU_Display *display, uint16_t address, uint16_t old, uint16_t value)
+{
+	if(display->video == 0 || old == value)
+		return;
+	if((uint16_t) (address - display->video) < DCPU_DISPLAY_CELLS)
+		display_mark(display, (uint16_t) (address - display->video));
+	else if(display->font != 0 && (uint16_t) (address - display->font) < sizeof display_font / sizeof *display_font)
+		display_mark_matching(display, (uint16_t) (address - display->font) / 2, -1);
+	else if(display->palette != 0 && (uint16_t) (address - display->palette) < sizeof display_palette / sizeof *display_palette)
+		display_mark_matching(display, -1, (uint16_t) (address - display->palette));
+}
+
+/* Checks if a range of memory, which may wrap around the end of the address space, overlaps a region. */
+static int display_overlaps(uint16_t address, size_t length, uint16_t start, size_t size)
+{
+	return length >= MEM_SIZE || (uint16_t) (start - address) < length || (uint16_t) (address - start) < size;
+}
+
+/* Tracks a range of memory being replaced wholesale. */
+static void display_changed(DCPU_Display *display, uint16_t address, size_t length)
+{
+	unsigned int	i;
+
+	if(display->video == 0)
+		return;
+	if((display->font != 0 && display_overlaps(address, length, display->font, sizeof display_font / sizeof *display_font)) ||
+	   (display->palette != 0 && display_overlaps(address, length, display->palette, sizeof display_palette / sizeof *display_palette)))
+	{
+		display_mark_all(display);
+		return;
+	}
+	if(!display_overlaps(address, length, display->video, DCPU_DISPLAY_CELLS))
+		return;
+	for(i = 0; i < DCPU_DISPLAY_CELLS; i++)
+	{
+		if(length >= MEM_SIZE || (uint16_t) (display->video + i - address) < length)
+			display_mark(display, i);
+	}
+}
+
+/** \brief Creates a LEM1802-style text display, and attaches it to a DCPU-16 instance.
+ *
+ * The display shows 32 by 12 cells of 4 by 8 pixels each. Each cell is one word of
+ * video memory, with the foreground color index in the top four bits, then the
+ * background color index, a blink bit, and a seven-bit glyph index.
+ *
+ * The display starts out disconnected, use DCPU_DisplayMap() to set where in memory
+ * it finds its video memory. An instance can have only one display; creating a new
+ * one replaces the old one.
+ *
+ * \return The new display, or \c NULL on failure. Destroy it with DCPU_DisplayDestroy().
+*/
+DCPU_Display * DCPU_DisplayCreate(DCPU_State *cpu)
+{
+	DCPU_Display	*display;
+
+	if((display = calloc(1, sizeof *display)) != NULL)
+	{
+		display->cpu = cpu;
+		display_mark_all(display);
+		cpu->display = display;
+	}
+	return display;
+}
+
+/** \brief Detaches a display from its instance, and destroys it. */
+void DCPU_DisplayDestroy(DCPU_Display *display)
+{
+	if(display == NULL)
+		return;
+	if(display->cpu->display == display)
+		display->cpu->display = NULL;
+	free(display);
+}
+
+/** \brief Sets where in memory the display finds its data.
+ *
+ * \param video Address of the 384 words of video memory, or 0 to disconnect the display.
+ * \param font Address of a 256-word font, two words per glyph, or 0 to use the built-in one.
+ * \param palette Address of a 16-word palette of 0x0RGB colors, or 0 to use the built-in one.
+*/
+void DCPU_DisplayMap(DCPU_Display *display, uint16_t video, uint16_t font, uint16_t palette)
+{
+	display->video = video;
+	display->font = font;
+	display->palette = palette;
+	display_mark_all(display);
+}
+
+/* Renders a single cell into a 128 by 96 pixel frame. */
+static void display_render_cell(const DCPU_Display *display, unsigned int index, uint8_t *rgba, size_t stride)
+{
+	const uint16_t	*memory = display->cpu->memory;
+	const uint16_t	cell = display->video != 0 ? memory[(uint16_t) (display->video + index)] : 0;
+	const uint16_t	glyph = cell & 0x7f;
+	uint16_t	colors[2], glyph_words[2];
+	uint8_t		rgb[2][3];
+	unsigned int	x, y, i;
+
+	colors[0] = (cell >> 8) & 0xf;
+	colors[1] = (cell & 0x80) && !display->blink ? colors[0] : cell >> 12;
+	for(i = 0; i < 2; i++)
+	{
+		const uint16_t	color = display->palette != 0 ? memory[(uint16_t) (display->palette + colors[i])] : display_palette[colors[i]];
+
+		rgb[i][0] = 17 * ((color >> 8) & 0xf);
+		rgb[i][1] = 17 * ((color >> 4) & 0xf);
+		rgb[i][2] = 17 * (color & 0xf);
+		glyph_words[i] = display->font != 0 ? memory[(uint16_t) (display->font + 2 * glyph + i)] : display_font[2 * glyph + i];
+	}
+	rgba += (index / DCPU_DISPLAY_COLUMNS) * 8 * stride + (index % DCPU_DISPLAY_COLUMNS) * 4 * 4;
+	for(y = 0; y < 8; y++, rgba += stride)
+	{
+		for(x = 0; x < 4; x++)
+		{
+			const uint8_t	column = glyph_words[x / 2] >> (x % 2 ? 0 : 8);
+			const uint8_t	*color = rgb[(column >> y) & 1];
+
+			rgba[4 * x + 0] = color[0];
+			rgba[4 * x + 1] = color[1];
+			rgba[4 * x + 2] = color[2];
+			rgba[4 * x + 3] = 0xff;
+		}
+	}
+}
+
+/** \brief Renders the cells that have changed since the last frame.
+ *
+ * Only cells that have changed are drawn, so the same frame buffer should be
+ * passed every time. The first frame after creating or mapping the display draws
+ * every cell. If nothing has changed, and no blinking cells need to toggle, this
+ * returns without looking at memory.
+ *
+ * \param rgba A frame buffer of DCPU_DISPLAY_WIDTH by DCPU_DISPLAY_HEIGHT pixels, four bytes
+ *        (red, green, blue and alpha) each.
+ * \param stride The distance between rows in the frame buffer, in bytes.
+ * \param blink Whether blinking cells are visible in this frame.
+ * \param ranges Receives the ranges of cells that were drawn, in increasing order. If there
+ *        are more than \p max_ranges, the last one is extended to cover the rest. May be \c NULL
+ *        if \p max_ranges is 0.
+ * \param max_ranges The number of entries in \p ranges.
+ *
+ * \return The number of ranges stored in \p ranges.
+*/
+size_t DCPU_DisplayRender(DCPU_Display *display, uint8_t *rgba, size_t stride, int blink, DCPU_CellRange *ranges, size_t max_ranges)
+{
+	size_t		num_ranges = 0;
+	unsigned int	i;
+
+	blink = blink != 0;
+	if(blink != display->blink)
+	{
+		display->blink = blink;
+		if(display->video != 0)
+		{
+			for(i = 0; i < DCPU_DISPLAY_CELLS; i++)
+			{
+				if(display->cpu->memory[(uint16_t) (display->video + i)] & 0x80)
+					display_mark(display, i);
+			}
+		}
+	}
+	if(!display->any_dirty)
+		return 0;
+
+	for(i = 0; i < DCPU_DISPLAY_CELLS; i++)
+	{
+		if((display->dirty[i / 32] & (1u << (i % 32))) == 0)
+			continue;
+		display_render_cell(display, i, rgba, stride);
+		if(max_ranges == 0)
+			continue;
+		if(num_ranges > 0 && (ranges[num_ranges - 1].first + ranges[num_ranges - 1].count == i || num_ranges == max_ranges))
+			ranges[num_ranges - 1].count = i + 1 - ranges[num_ranges - 1].first;
+		else
+		{
+			ranges[num_ranges].first = i;
+			ranges[num_ranges].count = 1;
+			num_ranges++;
+		}
+	}
+	memset(display->dirty, 0, sizeof display->dirty);
+	display->any_dirty = 0;
+
+	return num_ranges;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* Layout of save-state files. All header fields are little-endian, memory is stored in chunks
+ * of 4 KiB each, in the byte order given by the header's flags. Chunks that are all zeroes are
+ * not stored at all. Uncompressed chunks are aligned to their size in the file, so that they
+ * can be mapped straight into an instance's memory on hosts with 4 KiB pages.
+*/
+#define	SAVE_MAGIC		"CADESAVE"
+#define	SAVE_VERSION		1
+#define	SAVE_FLAG_BIG_ENDIAN	(1 << 0)
+#define	SAVE_CHUNK_WORDS	2048
+#define	SAVE_CHUNK_BYTES	(SAVE_CHUNK_WORDS * 2)
+#define	SAVE_CHUNK_COUNT	(MEM_SIZE / SAVE_CHUNK_WORDS)
+#define	SAVE_OFFSET_REGISTERS	16
+#define	SAVE_OFFSET_PIPELINE	44
+#define	SAVE_OFFSET_TIMER	56
+#define	SAVE_OFFSET_CHUNKS	64
+#define	SAVE_OFFSET_DIGESTS	(SAVE_OFFSET_CHUNKS + 8 * SAVE_CHUNK_COUNT)
+#define	SAVE_HEADER_SIZE	(SAVE_OFFSET_DIGESTS + 8 * PAGE_COUNT)
+
+/** \brief A save-state file, opened for restoring into any number of instances. */
+struct DCPU_StateFile {
+	int		fd;				/**< The open file, which chunks are mapped from. */
+	const uint8_t	*data;				/**< The whole file, mapped read-only. */
+	size_t		size;				/**< Size of the file, in bytes. */
+	int		swap;				/**< Set if memory is stored in the other byte order. */
+};
+
+static void put16(uint8_t *p, uint16_t x)
+{
+	p[0] = x;
+	p[1] = x >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t x)
+{
+	put16(p, x);
+	put16(p + 2, x >> 16);
+}
+
+static void put64(uint8_t *p, uint64_t x)
+{
+	put32(p, x);
+	put32(p + 4, x >> 32);
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	return get16(p) | (uint32_t) get16(p + 2) << 16;
+}
+
+static uint64_t get64(const uint8_t *p)
+{
+	return get32(p) | (uint64_t) get32(p + 4) << 32;
+}
+
+static int host_is_big_endian(void)
+{
+	const uint16_t	probe = 1;
+
+	return *(const uint8_t *) &probe == 0;
+}
+
+/* Copies words from a byte buffer, which needn't be aligned, optionally swapping their bytes. */
+static void copy_words(uint16_t *dst, const uint8_t *src, size_t count, int swap)
+{
+	size_t	i = 0;
+
+	if(!swap)
+	{
+		memcpy(dst, src, count * sizeof *dst);
+		return;
+	}
+#if defined __AVX2__
+	for(; i + 16 <= count; i += 16)
+	{
+		const __m256i	v = _mm256_loadu_si256((const __m256i *) (src + 2 * i));
+
+		_mm256_storeu_si256((__m256i *) (dst + i), _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8)));
+	}
+#endif
+#if defined __SSE2__
+	for(; i + 8 <= count; i += 8)
+	{
+		const __m128i	v = _mm_loadu_si128((const __m128i *) (src + 2 * i));
+
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+	}
+#elif defined __ARM_NEON
+	for(; i + 8 <= count; i += 8)
+		vst1q_u8((uint8_t *) (dst + i), vrev16q_u8(vld1q_u8(src + 2 * i)));
+#endif
+	for(; i < count; i++)
+	{
+		uint16_t	word;
+
+		memcpy(&word, src + 2 * i, sizeof word);
+		dst[i] = __builtin_bswap16(word);
+	}
+}
+
+/* Compresses a chunk of memory with simple run-length encoding. A token word with the top bit
+ * set is followed by one word to repeat that many times, otherwise by that many literal words.
+ * Returns the compressed size in words, or 0 if it would not be smaller than the input.
+*/
+static size_t chunk_compress(const uint16_t *chunk, uint16_t *out)
+{
+	size_t	i = 0, length = 0, literal = 0;
+
+	while(i < SAVE_CHUNK_WORDS)
+	{
+		size_t	run = 1;
+
+		while(i + run < SAVE_CHUNK_WORDS && chunk[i + run] == chunk[i] && run < 0x7fff)
+			run++;
+		if(run >= 3)
+		{
+			if(length + 2 >= SAVE_CHUNK_WORDS)
+				return 0;
+			out[length++] = 0x8000 | run;
+			out[length++] = chunk[i];
+			i += run;
+			literal = 0;
+			continue;
+		}
+		if(literal == 0 || out[literal] == 0x7fff)
+		{
+			if(length + 1 >= SAVE_CHUNK_WORDS)
+				return 0;
+			literal = length;
+			out[length++] = 0;
+		}
+		if(length + 1 >= SAVE_CHUNK_WORDS)
+			return 0;
+		out[literal]++;
+		out[length++] = chunk[i++];
+	}
+	return length;
+}
+
+/* Expands a chunk compressed by chunk_compress(). Returns 0 if the data is malformed. */
+static int chunk_expand(const uint16_t *in, size_t length, int swap, uint16_t *chunk)
+{
+	size_t	i = 0, out = 0;
+
+	while(i < length)
+	{
+		const uint16_t	token = swap ? __builtin_bswap16(in[i]) : in[i];
+		const size_t	count = token & 0x7fff;
+
+		if(out + count > SAVE_CHUNK_WORDS || i + 1 + ((token & 0x8000) ? 1 : count) > length)
+			return 0;
+		if(token & 0x8000)
+		{
+			const uint16_t	value = swap ? __builtin_bswap16(in[i + 1]) : in[i + 1];
+			size_t		j;
+
+			for(j = 0; j < count; j++)
+				chunk[out++] = value;
+			i += 2;
+		}
+		else
+		{
+			size_t	j;
+
+			for(j = 0; j < count; j++)
+				chunk[out++] = swap ? __builtin_bswap16(in[i + 1 + j]) : in[i + 1 + j];
+			i += 1 + count;
+		}
+	}
+	return out == SAVE_CHUNK_WORDS;
+}
+
+/* Writes zero bytes to a stream until its position is a multiple of the chunk size. */
+static int save_align(FILE *out)
+{
+	long	position;
+
+	if((position = ftell(out)) < 0)
+		return 0;
+	for(; position % SAVE_CHUNK_BYTES != 0; position++)
+	{
+		if(fputc(0, out) == EOF)
+			return 0;
+	}
+	return 1;
+}
+
+/** \brief Saves the complete state of an instance to a file.
+ *
+ * The file records memory, registers, the cycle counter, and any partially executed
+ * instruction, in a form that doesn't depend on the host or on where the instance
+ * lives in memory. Memory is stored in 4 KiB chunks, and chunks that are all
+ * zeroes are left out.
+ *
+ * The state is written to a temporary file in the same directory, which is then renamed
+ * over \p filename. An existing file is thus replaced rather than rewritten, so instances
+ * restored from it, which may still have it mapped, are not affected.
+ *
+ * \param filename The name of the file to write.
+ * \param flags Zero, or DCPU_SAVE_COMPRESS to compress memory. Compressed chunks are smaller,
+ *        but have to be copied when restoring instead of being mapped straight from the file.
+ *
+ * \return 1 on success, 0 on failure.
+*/
+int DCPU_SaveState(const DCPU_State *cpu, const char *filename, unsigned int flags)
+{
+	uint8_t		header[SAVE_HEADER_SIZE];
+	uint16_t	packed[SAVE_CHUNK_WORDS];
+	uint32_t	offsets[SAVE_CHUNK_COUNT], sizes[SAVE_CHUNK_COUNT];
+	FILE		*out;
+	char		*temporary;
+	struct stat	st;
+	size_t		i, page;
+	int		fd, ok;
+
+	if((temporary = malloc(strlen(filename) + 8)) == NULL)
+		return 0;
+	sprintf(temporary, "%s.XXXXXX", filename);
+	if((fd = mkstemp(temporary)) < 0)
+	{
+		free(temporary);
+		return 0;
+	}
+	if((out = fdopen(fd, "wb")) == NULL)
+	{
+		close(fd);
+		unlink(temporary);
+		free(temporary);
+		return 0;
+	}
+	memset(header, 0, sizeof header);
+	ok = fwrite(header, sizeof header, 1, out) == 1;
+	for(i = 0; ok && i < SAVE_CHUNK_COUNT; i++)
+	{
+		const uint16_t	*chunk = cpu->memory + i * SAVE_CHUNK_WORDS;
+		size_t		length = 0, j;
+
+		offsets[i] = sizes[i] = 0;
+		for(j = 0; j < SAVE_CHUNK_WORDS && chunk[j] == 0; j++)
+			;
+		if(j == SAVE_CHUNK_WORDS)
+			continue;
+		if((flags & DCPU_SAVE_COMPRESS) && (length = chunk_compress(chunk, packed)) > 0)
+		{
+			offsets[i] = ftell(out);
+			sizes[i] = length * sizeof *packed;
+			ok = fwrite(packed, sizeof *packed, length, out) == length;
+		}
+		else if((ok = save_align(out)) != 0)
+		{
+			offsets[i] = ftell(out);
+			sizes[i] = SAVE_CHUNK_BYTES;
+			ok = fwrite(chunk, sizeof *chunk, SAVE_CHUNK_WORDS, out) == SAVE_CHUNK_WORDS;
+		}
+	}
+
+	memcpy(header, SAVE_MAGIC, 8);
+	put16(header + 8, SAVE_VERSION);
+	put16(header + 10, host_is_big_endian() ? SAVE_FLAG_BIG_ENDIAN : 0);
+	put32(header + 12, SAVE_HEADER_SIZE);
+	for(i = 0; i < DCPU_REG_COUNT; i++)
+		put16(header + SAVE_OFFSET_REGISTERS + 2 * i, cpu->registers[i]);
+	put16(header + SAVE_OFFSET_REGISTERS + 16, cpu->sp);
+	put16(header + SAVE_OFFSET_REGISTERS + 18, cpu->pc);
+	put16(header + SAVE_OFFSET_REGISTERS + 20, cpu->o);
+	put16(header + SAVE_OFFSET_REGISTERS + 22, cpu->inst);
+	put16(header + SAVE_OFFSET_REGISTERS + 24, cpu->inst_pc);
+	put16(header + SAVE_OFFSET_REGISTERS + 26, cpu->dummy);
+	header[SAVE_OFFSET_PIPELINE] = cpu->skip;
+	header[SAVE_OFFSET_PIPELINE + 1] = thunk_index(cpu->cycle);
+	put32(header + SAVE_OFFSET_PIPELINE + 4, value_ref(cpu, cpu->val_a));
+	put32(header + SAVE_OFFSET_PIPELINE + 8, value_ref(cpu, cpu->val_b));
+	put64(header + SAVE_OFFSET_TIMER, cpu->timer);
+	for(i = 0; i < SAVE_CHUNK_COUNT; i++)
+	{
+		put32(header + SAVE_OFFSET_CHUNKS + 8 * i, offsets[i]);
+		put32(header + SAVE_OFFSET_CHUNKS + 8 * i + 4, sizes[i]);
+	}
+	/* Page digests are saved too, so restoring doesn't have to touch memory to rehash it. */
+	for(page = 0; page < PAGE_COUNT; page++)
+	{
+		uint64_t	digest = cpu->page_hash[page];
+
+		if(cpu->hash_stale[page / 32] & (1u << (page % 32)))
+		{
+			for(i = page * PAGE_SIZE, digest = 0; i < (page + 1) * PAGE_SIZE; i++)
+				digest ^= hash_word(i, cpu->memory[i]);
+		}
+		put64(header + SAVE_OFFSET_DIGESTS + 8 * page, digest);
+	}
+	ok = ok && fseek(out, 0, SEEK_SET) == 0 && fwrite(header, sizeof header, 1, out) == 1;
+	ok = fclose(out) == 0 && ok;
+	/* The temporary file is only readable by its owner, unlike the one it replaces. */
+	ok = ok && chmod(temporary, stat(filename, &st) == 0 ? st.st_mode & 07777 : 0644) == 0 && rename(temporary, filename) == 0;
+	if(!ok)
+		unlink(temporary);
+	free(temporary);
+
+	return ok;
+}
+
+/** \brief Opens a save-state file for restoring.
+ *
+ * The file is mapped into memory and checked, and then kept open so that any number of
+ * instances can be restored from it with DCPU_StateFileRestore().
+ *
+ * \param filename The name of a file written by DCPU_SaveState().
+ *
+ * \return The opened file, or \c NULL if it could not be opened or is not a valid save-state.
+*/
+DCPU_StateFile * DCPU_StateFileOpen(const char *filename)
+{
+	DCPU_StateFile	*file;
+	struct stat	st;
+	size_t		i;
+
+	if((file = calloc(1, sizeof *file)) == NULL)
+		return NULL;
+	file->data = MAP_FAILED;
+	if((file->fd = open(filename, O_RDONLY)) < 0 || fstat(file->fd, &st) != 0 || st.st_size < SAVE_HEADER_SIZE)
+		goto fail;
+	file->size = st.st_size;
+	if((file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, file->fd, 0)) == MAP_FAILED)
+		goto fail;
+	if(memcmp(file->data, SAVE_MAGIC, 8) != 0 || get16(file->data + 8) != SAVE_VERSION || get32(file->data + 12) < SAVE_HEADER_SIZE)
+		goto fail;
+	if(file->data[SAVE_OFFSET_PIPELINE + 1] >= sizeof thunks / sizeof *thunks)
+		goto fail;
+	for(i = 0; i < SAVE_CHUNK_COUNT; i++)
+	{
+		const uint32_t	offset = get32(file->data + SAVE_OFFSET_CHUNKS + 8 * i);
+		const uint32_t	size = get32(file->data + SAVE_OFFSET_CHUNKS + 8 * i + 4);
+
+		/* Compressed chunks are read a word at a time, so they have to be aligned to one. */
+		if(offset != 0 && (size > SAVE_CHUNK_BYTES || size % 2 != 0 || offset % 2 != 0 || offset > file->size || size > file->size - offset))
+			goto fail;
+	}
+	file->swap = !(get16(file->data + 10) & SAVE_FLAG_BIG_ENDIAN) != !host_is_big_endian();
+
+	return file;
+fail:
+	DCPU_StateFileClose(file);
+	return NULL;
+}
+
+/** \brief Closes a save-state file.
+ *
+ * Instances restored from the file are not affected, and can keep running.
+*/
+void DCPU_StateFileClose(DCPU_StateFile *file)
+{
+	if(file == NULL)
+		return;
+	if(file->data != MAP_FAILED)
+		munmap((void *) file->data, file->size);
+	if(file->fd >= 0)
+		close(file->fd);
+	free(file);
+}
+
+/* Maps a run of chunks straight into an instance's memory: from the file, copy-on-write,
+ * if there is one, otherwise fresh zero pages.
+*/
+static int restore_map(DCPU_State *cpu, const DCPU_StateFile *file, size_t first, size_t count, off_t offset)
+{
+	void	*target = cpu->memory + first * SAVE_CHUNK_WORDS;
+	void	*mapped;
+
+	if(offset != 0)
+		mapped = mmap(target, count * SAVE_CHUNK_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, file->fd, offset);
+	else
+		mapped = mmap(target, count * SAVE_CHUNK_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS, -1, 0);
+
+	return mapped == target;
+}
+
+/** \brief Restores an instance from an opened save-state file.
+ *
+ * If the instance was created by DCPU_Create(), and the file's uncompressed chunks are
+ * in the host's byte order, memory is restored by mapping the file's pages into the
+ * instance copy-on-write. This doesn't read or copy any memory up front, so any number
+ * of instances can quickly be started from the same file, sharing the pages that they
+ * never write to. Otherwise, memory is copied from the file.
+ *
+ * Mapped instances read the file for as long as they live, so it must not be modified in
+ * place: its contents would show up in their memory, and truncating it makes them crash.
+ * Replacing it, as DCPU_SaveState() does, is fine.
+ *
+ * Attachments such as coverage maps and displays are kept, and counters are not reset.
+ *
+ * \return 1 on success, 0 on failure, in which case the instance's state is undefined.
+*/
+int DCPU_StateFileRestore(const DCPU_StateFile *file, DCPU_State *cpu)
+{
+	const uint8_t	*header = file->data;
+	const long	page_size = sysconf(_SC_PAGESIZE);
+	const int	can_map = !file->swap && page_size == SAVE_CHUNK_BYTES && (uintptr_t) cpu->memory % SAVE_CHUNK_BYTES == 0;
+	size_t		i, j;
+
+	for(i = 0; i < SAVE_CHUNK_COUNT; i = j)
+	{
+		const off_t	offset = get32(header + SAVE_OFFSET_CHUNKS + 8 * i);
+		const uint32_t	size = get32(header + SAVE_OFFSET_CHUNKS + 8 * i + 4);
+		uint16_t	*chunk = cpu->memory + i * SAVE_CHUNK_WORDS;
+		/* Files that weren't written by DCPU_SaveState() may have chunks that can't be mapped. */
+		const int	mappable = can_map && (offset == 0 || (size == SAVE_CHUNK_BYTES && offset % SAVE_CHUNK_BYTES == 0));
+
+		/* Gather runs of chunks that are zero, or consecutive in the file, to map them in one go. */
+		for(j = i + 1; mappable && j < SAVE_CHUNK_COUNT; j++)
+		{
+			const off_t	next = get32(header + SAVE_OFFSET_CHUNKS + 8 * j);
+
+			if(offset == 0 ? next != 0 : next != offset + (off_t) (j - i) * SAVE_CHUNK_BYTES || get32(header + SAVE_OFFSET_CHUNKS + 8 * j + 4) != SAVE_CHUNK_BYTES)
+				break;
+		}
+		if(mappable)
+		{
+			if(!restore_map(cpu, file, i, j - i, offset))
+				return 0;
+			continue;
+		}
+		j = i + 1;
+		if(offset == 0)
+			memset(chunk, 0, SAVE_CHUNK_BYTES);
+		else if(size == SAVE_CHUNK_BYTES)
+			copy_words(chunk, file->data + offset, SAVE_CHUNK_WORDS, file->swap);
+		else if(!chunk_expand((const uint16_t *) (file->data + offset), size / 2, file->swap, chunk))
+			return 0;
+	}
+
+	for(i = 0; i < DCPU_REG_COUNT; i++)
+		cpu->registers[i] = get16(header + SAVE_OFFSET_REGISTERS + 2 * i);
+	cpu->sp = get16(header + SAVE_OFFSET_REGISTERS + 16);
+	cpu->pc = get16(header + SAVE_OFFSET_REGISTERS + 18);
+	cpu->o = get16(header + SAVE_OFFSET_REGISTERS + 20);
+	cpu->inst = get16(header + SAVE_OFFSET_REGISTERS + 22);
+	cpu->inst_pc = get16(header + SAVE_OFFSET_REGISTERS + 24);
+	cpu->dummy = get16(header + SAVE_OFFSET_REGISTERS + 26);
+	cpu->skip = header[SAVE_OFFSET_PIPELINE];
+	cpu->cycle = thunks[header[SAVE_OFFSET_PIPELINE + 1]];
+	if(!value_unref(cpu, get32(header + SAVE_OFFSET_PIPELINE + 4), &cpu->val_a) ||
+	   !value_unref(cpu, get32(header + SAVE_OFFSET_PIPELINE + 8), &cpu->val_b))
+		return 0;
+	cpu->timer = get64(header + SAVE_OFFSET_TIMER);
+
+	cpu->memory_hash = 0;
+	for(i = 0; i < PAGE_COUNT; i++)
+	{
+		cpu->page_hash[i] = get64(header + SAVE_OFFSET_DIGESTS + 8 * i);
+		cpu->memory_hash ^= cpu->page_hash[i];
+	}
+	memset(cpu->hash_stale, 0, sizeof cpu->hash_stale);
+	memset(cpu->dirty, 0xff, sizeof cpu->dirty);
+	if(cpu->display != NULL)
+		display_changed(cpu->display, 0, MEM_SIZE);
+	if(cpu->history != NULL)
+		history_changed(cpu);
+	schedule_events(cpu);
+
+	return 1;
+}
+
+/** \brief Restores an instance from a save-state file.
+ *
+ * This is a convenience wrapper that opens the file, restores from it and closes it again.
+ * When starting many instances from the same file, open it once with DCPU_StateFileOpen().
+ *
+ * \return 1 on success, 0 on failure.
+*/
+int DCPU_LoadState(DCPU_State *cpu, const char *filename)
+{
+	DCPU_StateFile	*file;
+	int		ok;
+
+	if((file = DCPU_StateFileOpen(filename)) == NULL)
+		return 0;
+	ok = DCPU_StateFileRestore(file, cpu);
+	DCPU_StateFileClose(file);
+
+	return ok;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/** \brief Size of the optional header of image files, in bytes. */
+#define	IMAGE_HEADER_SIZE	8
+
+/** \brief Flag in the header of image files, set if the words are little-endian. */
+#define	IMAGE_FLAG_LITTLE_ENDIAN	(1 << 0)
+
+/** \brief A binary image, mapped from a file, to load into any number of instances. */
+struct DCPU_Image {
+	void		*mapping;			/**< The whole file, mapped read-only. */
+	size_t		size;				/**< Size of the mapping, in bytes. */
+	const uint16_t	*words;				/**< The image's words, in host byte order. */
+	uint16_t	*swapped;			/**< Byte-swapped copy of the words, if they needed that, or NULL. */
+	size_t		length;				/**< Length of the image, in words. */
+	uint16_t	address;			/**< Address to load the image at, if it has a header. */
+	int		header;				/**< Set if the image has a header. */
+};
+
+/* Maps a whole file read-only. Returns NULL on failure, including if it's empty. */
+static void * map_file(const char *filename, size_t *size)
+{
+	struct stat	st;
+	void		*mapping = NULL;
+	int		fd;
+
+	if((fd = open(filename, O_RDONLY)) < 0)
+		return NULL;
+	if(fstat(fd, &st) == 0 && st.st_size > 0)
+	{
+		*size = st.st_size;
+		if((mapping = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+			mapping = NULL;
+		else
+			madvise(mapping, *size, MADV_WILLNEED);
+	}
+	close(fd);
+
+	return mapping;
+}
+
+/* Works out the layout of an image file. Returns the offset of the first word, and sets the
+ * number of words, whether they're little-endian, and the address in the header if there is one.
+*/
+static size_t image_parse(const uint8_t *data, size_t size, DCPU_ImageFormat format, size_t *length, int *little, uint16_t *address)
+{
+	size_t	offset = 0;
+
+	*little = format == DCPU_IMAGE_LITTLE_ENDIAN;
+	if(format == DCPU_IMAGE_AUTO && size >= IMAGE_HEADER_SIZE && memcmp(data, "DC16", 4) == 0)
+	{
+		*address = data[4] << 8 | data[5];
+		*little = (data[7] & IMAGE_FLAG_LITTLE_ENDIAN) != 0;
+		offset = IMAGE_HEADER_SIZE;
+	}
+	*length = (size - offset) / 2;
+	if(*length > MEM_SIZE)
+		*length = MEM_SIZE;
+
+	return offset;
+}
+
+/** \brief Loads a binary image file into memory.
+ *
+ * The file is mapped and its words copied straight into memory, swapping bytes if needed.
+ * Like with DCPU_Load(), data past the end of memory wraps around to the start.
+ *
+ * \param address The address to load the image at, unless it has a header giving one.
+ * \param filename The name of the file.
+ * \param format The layout of the file.
+ *
+ * \return The number of words loaded, or 0 on failure.
+*/
+size_t DCPU_LoadFile(DCPU_State *cpu, uint16_t address, const char *filename, DCPU_ImageFormat format)
+{
+	const uint8_t	*data;
+	size_t		size, offset, length;
+	int		little;
+
+	if((data = map_file(filename, &size)) == NULL)
+		return 0;
+	offset = image_parse(data, size, format, &length, &little, &address);
+	load_words(cpu, address, data + offset, length, little == host_is_big_endian());
+	munmap((void *) data, size);
+
+	return length;
+}
+
+/** \brief Opens a binary image file, to load into any number of instances.
+ *
+ * The file is mapped into memory once. If its words are in the host's byte order they are
+ * loaded straight from the mapping, otherwise they are swapped once, here.
+ *
+ * \param filename The name of the file.
+ * \param format The layout of the file.
+ *
+ * \return The opened image, or \c NULL on failure.
+*/
+DCPU_Image * DCPU_ImageOpen(const char *filename, DCPU_ImageFormat format)
+{
+	DCPU_Image	*image;
+	size_t		offset;
+	int		little;
+
+	if((image = calloc(1, sizeof *image)) == NULL)
+		return NULL;
+	if((image->mapping = map_file(filename, &image->size)) == NULL)
+	{
+		free(image);
+		return NULL;
+	}
+	offset = image_parse(image->mapping, image->size, format, &image->length, &little, &image->address);
+	image->header = offset != 0;
+	image->words = (const uint16_t *) ((const uint8_t *) image->mapping + offset);
+	if(little == host_is_big_endian() && image->length > 0)
+	{
+		if((image->swapped = malloc(image->length * sizeof *image->swapped)) == NULL)
+		{
+			DCPU_ImageClose(image);
+			return NULL;
+		}
+		copy_words(image->swapped, (const uint8_t *) image->words, image->length, 1);
+		image->words = image->swapped;
+	}
+	return image;
+}
+
+/** \brief Closes a binary image. Instances it was loaded into are not affected. */
+void DCPU_ImageClose(DCPU_Image *image)
+{
+	if(image == NULL)
+		return;
+	munmap(image->mapping, image->size);
+	free(image->swapped);
+	free(image);
+}
+
+/** \brief Returns the length of an image, in words. */
+size_t DCPU_ImageGetLength(const DCPU_Image *image)
+{
+	return image->length;
+}
+
+/** \brief Loads an image into memory.
+ *
+ * \param address The address to load the image at, unless it has a header giving one.
+*/
+void DCPU_ImageLoad(const DCPU_Image *image, DCPU_State *cpu, uint16_t address)
+{
+	load_words(cpu, image->header ? image->address : address, (const uint8_t *) image->words, image->length, 0);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/** \brief The maximum number of instructions in a block compiled by DCPU_Recompile(). */
+#define	NATIVE_BLOCK_LENGTH	32
+
+/* Bits of what an instruction uses, as returned by native_uses(), after one bit per register. */
+#define	NATIVE_USES_SP		(1u << 8)
+#define	NATIVE_USES_O		(1u << 9)
+#define	NATIVE_USES_DUMMY	(1u << 10)
+#define	NATIVE_USES_MEMORY	(1u << 11)
+
+/** \brief How generated code gets at a value of an instruction, see native_operand(). */
+typedef enum {
+	NATIVE_LOCAL,					/**< A local variable, holding a register. */
+	NATIVE_CONSTANT,				/**< A literal. */
+	NATIVE_MEMORY,					/**< A word of memory, at the address in a local variable. */
+	NATIVE_PC					/**< The program counter, which reads as the address of the next instruction. */
+} NativeKind;
+
+/* Returns whether the module has a block for an address that can be run now: it has to be done
+ * before handle_events() needs to run, and the page it was compiled from must be unchanged.
+*/
+static int native_ready(DCPU_State *cpu, const DCPU_NativeModule *module, uint16_t pc, uint64_t timer)
+{
+	const uint16_t	page = pc / PAGE_SIZE;
+
+	if(module->blocks[pc] == NULL || timer + module->cycles[pc] > cpu->next_event)
+		return 0;
+	if(cpu->hash_stale[page / 32] & (1u << (page % 32)))
+		refresh_hashes(cpu);
+
+	return cpu->page_hash[page] == module->page_hashes[page];
+}
+
+/* Runs blocks from the module for as long as it has ready ones, or until one of them needs the
+ * instance brought up to date, which is then done.
+*/
+static void native_run(DCPU_State *cpu, const DCPU_NativeModule *module)
+{
+	const uint64_t		start = cpu->timer;
+	DCPU_NativeFrame	frame;
+	size_t			i;
+
+	frame.cpu = cpu;
+	frame.memory = cpu->memory;
+	memcpy(frame.registers, cpu->registers, sizeof frame.registers);
+	frame.sp = cpu->sp;
+	frame.pc = cpu->pc;
+	frame.o = cpu->o;
+	frame.dummy = cpu->dummy;
+	frame.timer = start;
+	frame.instructions = 0;
+	frame.exit = 0;
+	frame.looped = 0;
+	memset(frame.written, 0, sizeof frame.written);
+	/* Writes into compiled pages go through store() too, so that their digests stop matching. */
+	for(i = 0; i < PAGE_COUNT; i++)
+	{
+		frame.read_hooks[i] = cpu->device_pages[i] != 0;
+		frame.write_hooks[i] = frame.read_hooks[i] || (module->code_pages[i / 32] & (1u << (i % 32))) != 0;
+	}
+	if(cpu->watch < MEM_SIZE)
+		frame.write_hooks[cpu->watch / PAGE_SIZE] = 1;
+	if(cpu->io_port < MEM_SIZE)
+		frame.write_hooks[cpu->io_port / PAGE_SIZE] = 1;
+
+	do
+		module->blocks[frame.pc](&frame);
+	while(!frame.exit && !frame.looped && !atomic_load_explicit(&cpu->stop_request, memory_order_relaxed) &&
+	      native_ready(cpu, module, frame.pc, frame.timer));
+
+	memcpy(cpu->registers, frame.registers, sizeof cpu->registers);
+	cpu->sp = frame.sp;
+	cpu->pc = frame.pc;
+	cpu->o = frame.o;
+	cpu->dummy = frame.dummy;
+	cpu->timer = frame.timer;
+	cpu->metrics.cycles += frame.timer - start;
+	cpu->metrics.instructions += frame.instructions;
+	for(i = 0; i < sizeof frame.written / sizeof *frame.written; i++)
+	{
+		while(frame.written[i] != 0)
+		{
+			const unsigned int	bit = __builtin_ctz(frame.written[i]);
+
+			memory_stored(cpu, (32 * i + bit) * PAGE_SIZE, PAGE_SIZE);
+			frame.written[i] &= frame.written[i] - 1;
+		}
+	}
+	if(frame.looped)
+	{
+		cpu->inst_pc = cpu->pc;
+		cpu->looped = 1;
+		cpu->next_event = 0;
+	}
+	if(atomic_load_explicit(&cpu->stop_request, memory_order_relaxed))
+		cpu->next_event = 0;
+	if(cpu->timer >= cpu->next_event)
+		handle_events(cpu);
+}
+
+/** \brief Like DCPU_Run(), but runs natively compiled code where it can.
+ *
+ * A block from the module is run whenever an instruction is about to start at its address,
+ * as long as the page it was compiled from is unchanged, and it can't run past the budget
+ * or the next device event. Everything else, including code that has been written to and
+ * jumps to addresses the module has no block for, is run by the interpreter. The result is
+ * the same as that of DCPU_Run(), cycle for cycle.
+ *
+ * Breakpoints and a coverage map make this run everything with the interpreter. Of the
+ * metrics, native code only counts cycles, instructions and writes to devices.
+ *
+ * \param module A module generated by DCPU_Recompile(), compiled and linked into the host.
+*/
+DCPU_RunStatus DCPU_RunNative(DCPU_State *cpu, const DCPU_NativeModule *module, size_t budget, size_t *num_cycles)
+{
+	return run(cpu, module, budget, num_cycles);
+}
+
+/** \brief Reads a word of memory for natively compiled code, from a page with a device in it.
+ *
+ * The device is brought up to date first, and the frame marked for the block to return
+ * after the current instruction, so that anything the device did can be handled.
+ *
+ * \param timer The cycle the read happens at.
+*/
+uint16_t DCPU_NativeLoad(DCPU_NativeFrame *frame, uint16_t address, uint64_t timer)
+{
+	DCPU_State	*cpu = frame->cpu;
+
+	cpu->timer = timer;
+	if(cpu->device_pages[address / PAGE_SIZE] != 0)
+		device_read(cpu, address);
+	frame->exit = 1;
+
+	return cpu->memory[address];
+}
+
+/** \brief Writes a word of memory for natively compiled code, into a page that needs more than that.
+ *
+ * This does everything the interpreter does for a write, and marks the frame for the block
+ * to return after the current instruction.
+ *
+ * \param timer The cycle the write happens at.
+*/
+void DCPU_NativeStore(DCPU_NativeFrame *frame, uint16_t address, uint16_t value, uint64_t timer)
+{
+	DCPU_State	*cpu = frame->cpu;
+
+	cpu->timer = timer;
+	store(cpu, &cpu->memory[address], value);
+	frame->exit = 1;
+}
+
+/* Returns whether an instruction is one of the IFx ones. */
+static int native_if(uint16_t inst)
+{
+	return (inst & 0xf) >= OP_IFE;
+}
+
+/* Returns whether an instruction is JSR. */
+static int native_jsr(uint16_t inst)
+{
+	return (inst & 0xf) == OP_NOBASIC && ((inst >> 4) & 0x3f) == XOP_JSR;
+}
+
+/* Returns whether an instruction changes PC, other than by going on to the next instruction. */
+static int native_jumps(uint16_t inst)
+{
+	return native_jsr(inst) || ((inst & 0xf) != OP_NOBASIC && !native_if(inst) && ((inst >> 4) & 0x3f) == VAL_PC);
+}
+
+/* Returns whether the instruction at an address can be compiled: it must be valid, and lie
+ * within a single page, since that's what native_ready() checks the digest of.
+*/
+static int native_compilable(const uint16_t *memory, uint16_t address)
+{
+	const uint16_t	inst = memory[address];
+
+	if((inst & 0xf) == OP_NOBASIC && !native_jsr(inst))
+		return 0;
+
+	return address % PAGE_SIZE + DCPU_InstructionLength(inst) <= PAGE_SIZE;
+}
+
+/* Returns the number of cycles an instruction takes, when it isn't skipped. */
+static unsigned int native_cycles(uint16_t inst)
+{
+	unsigned int	cycles;
+
+	switch(inst & 0xf)
+	{
+	case OP_SET:
+	case OP_AND:
+	case OP_BOR:
+	case OP_XOR:
+		cycles = 1;
+		break;
+	case OP_DIV:
+	case OP_MOD:
+		cycles = 3;
+		break;
+	default:
+		cycles = 2;
+		break;
+	}
+
+	return cycles + DCPU_InstructionLength(inst) - 1;
+}
+
+/* Returns what a value uses, as NATIVE_USES bits. */
+static unsigned int native_value_uses(unsigned int value, int dest)
+{
+	if(value <= VAL_REG_J)
+		return 1u << value;
+	if(value <= VAL_SUCC_REG_J)
+		return 1u << (value % 8) | NATIVE_USES_MEMORY;
+	if(value <= VAL_PUSH)
+		return NATIVE_USES_SP | NATIVE_USES_MEMORY;
+	switch(value)
+	{
+	case VAL_SP:
+		return NATIVE_USES_SP;
+	case VAL_PC:
+		return 0;
+	case VAL_O:
+		return NATIVE_USES_O;
+	case VAL_SUCC:
+		return NATIVE_USES_MEMORY;
+	case VAL_SUCC_LIT:
+		return dest ? NATIVE_USES_MEMORY : 0;
+	}
+
+	return dest ? NATIVE_USES_DUMMY : 0;
+}
+
+/* Returns what an instruction uses, as NATIVE_USES bits. */
+static unsigned int native_uses(uint16_t inst)
+{
+	const unsigned int	op = inst & 0xf;
+
+	if(op == OP_NOBASIC)
+		return native_value_uses(inst >> 10, 0) | NATIVE_USES_SP | NATIVE_USES_MEMORY;
+
+	return native_value_uses((inst >> 4) & 0x3f, 1) | native_value_uses(inst >> 10, 0) |
+		(op >= OP_ADD && op <= OP_SHR && op != OP_MOD ? NATIVE_USES_O : 0);
+}
+
+/* Finds where a jump goes, if that's fixed: a SET, ADD or SUB of a literal to PC, or a JSR to one. */
+static int native_target(const uint16_t *memory, uint16_t address, uint16_t *target)
+{
+	const uint16_t		inst = memory[address], after = address + DCPU_InstructionLength(inst);
+	const unsigned int	b = inst >> 10;
+	uint16_t		value;
+
+	if(b >= 0x20)
+		value = b - 0x20;
+	else if(b == VAL_SUCC_LIT)
+		value = memory[(uint16_t) (after - 1)];
+	else
+		return 0;
+	switch(inst & 0xf)
+	{
+	case OP_NOBASIC:
+	case OP_SET:
+		*target = value;
+		return 1;
+	case OP_ADD:
+		*target = after + value;
+		return 1;
+	case OP_SUB:
+		*target = after - value;
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* Finds the instructions of the block starting at an address, and returns how many there are.
+ * A block stays within its page, and ends after a jump that isn't conditional. An IFx is only
+ * included together with the instruction it may skip, so that blocks never end skipping.
+*/
+static size_t native_scan(const uint16_t *memory, uint16_t start, uint16_t *pcs, uint16_t *next)
+{
+	uint16_t	pc = start;
+	size_t		count = 0;
+
+	while(count < NATIVE_BLOCK_LENGTH && pc / PAGE_SIZE == start / PAGE_SIZE && native_compilable(memory, pc))
+	{
+		const uint16_t	inst = memory[pc], after = pc + DCPU_InstructionLength(inst);
+
+		if(native_if(inst))
+		{
+			if(count + 2 > NATIVE_BLOCK_LENGTH || after / PAGE_SIZE != start / PAGE_SIZE ||
+			   !native_compilable(memory, after) || native_if(memory[after]))
+				break;
+			pcs[count++] = pc;
+			pcs[count++] = after;
+			pc = after + DCPU_InstructionLength(memory[after]);
+			continue;
+		}
+		pcs[count++] = pc;
+		pc = after;
+		if(native_jumps(inst))
+			break;
+	}
+	*next = pc;
+
+	return count;
+}
+
+/* Adds an address to the ones DCPU_Recompile() is to look at, unless it already has been. */
+static void native_visit(uint32_t *seen, uint16_t *pending, size_t *num_pending, uint16_t address)
+{
+	if(seen[address / 32] & (1u << (address % 32)))
+		return;
+	seen[address / 32] |= 1u << (address % 32);
+	pending[(*num_pending)++] = address;
+}
+
+/* Writes the declaration of a local variable holding the address of an operand in memory, if it
+ * is one, and returns how to get at it. Anything else is put in expr, as a C expression.
+*/
+static NativeKind native_operand(FILE *out, const char *indent, const uint16_t *memory, unsigned int value, int dest,
+				 uint16_t *word, uint16_t after, char name, char *expr)
+{
+	const char	*registers = "abcxyzij";
+
+	if(value <= VAL_REG_J)
+	{
+		sprintf(expr, "r%c", registers[value]);
+		return NATIVE_LOCAL;
+	}
+	if(value <= VAL_DEREF_REG_J)
+		fprintf(out, "%sconst uint16_t x%c = r%c;\n", indent, name, registers[value % 8]);
+	else if(value <= VAL_SUCC_REG_J)
+		fprintf(out, "%sconst uint16_t x%c = 0x%04x + r%c;\n", indent, name, memory[(*word)++], registers[value % 8]);
+	else if(value == VAL_POP)
+		fprintf(out, "%sconst uint16_t x%c = sp++;\n", indent, name);
+	else if(value == VAL_PEEK)
+		fprintf(out, "%sconst uint16_t x%c = sp;\n", indent, name);
+	else if(value == VAL_PUSH)
+		fprintf(out, "%sconst uint16_t x%c = --sp;\n", indent, name);
+	else if(value == VAL_SUCC)
+		fprintf(out, "%sconst uint16_t x%c = 0x%04x;\n", indent, name, memory[(*word)++]);
+	else if(value == VAL_SUCC_LIT && dest)
+		fprintf(out, "%sconst uint16_t x%c = 0x%04x;\n", indent, name, (*word)++);
+	else
+	{
+		switch(value)
+		{
+		case VAL_SP:
+			strcpy(expr, "sp");
+			return NATIVE_LOCAL;
+		case VAL_PC:
+			sprintf(expr, "0x%04x", after);
+			return NATIVE_PC;
+		case VAL_O:
+			strcpy(expr, "o");
+			return NATIVE_LOCAL;
+		case VAL_SUCC_LIT:
+			sprintf(expr, "0x%04x", memory[(*word)++]);
+			return NATIVE_CONSTANT;
+		}
+		if(dest)
+		{
+			strcpy(expr, "dm");
+			return NATIVE_LOCAL;
+		}
+		sprintf(expr, "0x%04x", value - 0x20);
+		return NATIVE_CONSTANT;
+	}
+
+	return NATIVE_MEMORY;
+}
+
+/* Writes the declaration of a local variable holding the value of an operand, read at the cycle
+ * that is the given number of cycles before the end of the instruction.
+*/
+static void native_read(FILE *out, const char *indent, NativeKind kind, const char *expr, char name, unsigned int before)
+{
+	if(kind == NATIVE_MEMORY)
+		fprintf(out, "%sconst uint16_t v%c = READ(x%c, t - %u);\n", indent, name, name, before);
+	else
+		fprintf(out, "%sconst uint16_t v%c = %s;\n", indent, name, expr);
+}
+
+/* Writes the code that stores a value into the a operand of an instruction at an address. */
+static void native_write(FILE *out, const char *indent, NativeKind kind, const char *expr, const char *value, unsigned int before, uint16_t address)
+{
+	if(kind == NATIVE_MEMORY)
+		fprintf(out, "%sWRITE(xa, %s, t - %u);\n", indent, value, before);
+	else if(kind == NATIVE_PC)
+		fprintf(out, "%spc = %s;\n%sif(pc == 0x%04x)\n%s\tf->looped = 1;\n", indent, value, indent, address, indent);
+	else
+		fprintf(out, "%s%s = %s;\n", indent, expr, value);
+}
+
+/* Writes the code of the instruction at an address, and of the one it may skip if it's an IFx.
+ * Jumps end with a goto to the end of the block, which are counted.
+*/
+static void native_emit(FILE *out, const uint16_t *memory, uint16_t address, unsigned int depth, unsigned int *gotos)
+{
+	const uint16_t		inst = memory[address], length = DCPU_InstructionLength(inst), after = address + length;
+	const unsigned int	op = inst & 0xf, cycles = native_cycles(inst);
+	const unsigned int	store_before = op == OP_DIV || op == OP_MOD ? 2 : 1;
+	char			indent[16], a_expr[16], b_expr[16];
+	uint16_t		word = address + 1, i;
+	NativeKind		a, b;
+
+	memset(indent, '\t', depth);
+	indent[depth] = '\0';
+	fprintf(out, "%s/* 0x%04x:", indent, address);
+	for(i = 0; i < length; i++)
+		fprintf(out, " 0x%04x", memory[(uint16_t) (address + i)]);
+	fprintf(out, " */\n");
+
+	if(op == OP_NOBASIC)
+	{
+		/* JSR reads its operand after pushing the return address. */
+		b = native_operand(out, indent, memory, inst >> 10, 0, &word, after, 'b', b_expr);
+		fprintf(out, "%st += %u;\n%sn++;\n", indent, cycles, indent);
+		fprintf(out, "%s--sp;\n%sWRITE(sp, 0x%04x, t - 1);\n", indent, indent, after);
+		if(b == NATIVE_MEMORY)
+			fprintf(out, "%spc = READ(xb, t - %u);\n", indent, cycles);
+		else
+			fprintf(out, "%spc = %s;\n", indent, b_expr);
+		fprintf(out, "%sgoto out;\n", indent);
+		(*gotos)++;
+		return;
+	}
+
+	a = native_operand(out, indent, memory, (inst >> 4) & 0x3f, 1, &word, after, 'a', a_expr);
+	b = native_operand(out, indent, memory, inst >> 10, 0, &word, after, 'b', b_expr);
+	fprintf(out, "%st += %u;\n%sn++;\n", indent, cycles, indent);
+	if(op != OP_SET)
+		native_read(out, indent, a, a_expr, 'a', cycles);
+	native_read(out, indent, b, b_expr, 'b', cycles - DCPU_ValueLength((inst >> 4) & 0x3f));
+
+	switch((DCPU_BasicOp) op)
+	{
+	case OP_SET:
+		native_write(out, indent, a, a_expr, "vb", store_before, address);
+		break;
+	case OP_ADD:
+		fprintf(out, "%sconst uint32_t w = va + vb;\n", indent);
+		native_write(out, indent, a, a_expr, "w & 0xffff", store_before, address);
+		fprintf(out, "%so = w > 0xffff;\n", indent);
+		break;
+	case OP_SUB:
+		fprintf(out, "%sconst uint32_t w = (uint32_t) va - vb;\n", indent);
+		native_write(out, indent, a, a_expr, "w & 0xffff", store_before, address);
+		fprintf(out, "%so = w > 0xffff ? 0xffff : 0;\n", indent);
+		break;
+	case OP_MUL:
+		fprintf(out, "%sconst uint32_t w = (uint32_t) va * vb;\n", indent);
+		native_write(out, indent, a, a_expr, "w & 0xffff", store_before, address);
+		fprintf(out, "%so = w >> 16;\n", indent);
+		break;
+	case OP_DIV:
+		native_write(out, indent, a, a_expr, "vb != 0 ? va / vb : 0", store_before, address);
+		fprintf(out, "%so = vb != 0 ? (((uint32_t) va << 16) / vb) >> 16 : 0;\n", indent);
+		break;
+	case OP_MOD:
+		native_write(out, indent, a, a_expr, "vb != 0 ? va % vb : 0", store_before, address);
+		break;
+	case OP_SHL:
+		fprintf(out, "%sconst uint32_t w = vb < 32 ? (uint32_t) va << vb : 0;\n", indent);
+		native_write(out, indent, a, a_expr, "w & 0xffff", store_before, address);
+		fprintf(out, "%so = w >> 16;\n", indent);
+		break;
+	case OP_SHR:
+		fprintf(out, "%so = vb < 32 ? ((uint32_t) va << 16) >> vb : 0;\n", indent);
+		native_write(out, indent, a, a_expr, "vb < 32 ? va >> vb : 0", store_before, address);
+		break;
+	case OP_AND:
+		native_write(out, indent, a, a_expr, "va & vb", store_before, address);
+		break;
+	case OP_BOR:
+		native_write(out, indent, a, a_expr, "va | vb", store_before, address);
+		break;
+	case OP_XOR:
+		native_write(out, indent, a, a_expr, "va ^ vb", store_before, address);
+		break;
+	case OP_IFE:
+	case OP_IFN:
+	case OP_IFG:
+	case OP_IFB:
+		{
+			const char	*conditions[] = { "va == vb", "va != vb", "va > vb", "(va & vb) != 0" };
+
+			/* A skipped instruction takes two cycles, whatever its length. */
+			fprintf(out, "%sif(%s)\n%s{\n", indent, conditions[op - OP_IFE], indent);
+			native_emit(out, memory, after, depth + 1, gotos);
+			fprintf(out, "%s}\n%selse\n%s\tt += 2;\n", indent, indent, indent);
+		}
+		break;
+	case OP_NOBASIC:
+		break;
+	}
+	if(a == NATIVE_PC && !native_if(inst))
+	{
+		fprintf(out, "%sgoto out;\n", indent);
+		(*gotos)++;
+	}
+}
+
+/* Writes the function of the block made up of instructions found by native_scan(). */
+static void native_block(FILE *out, const uint16_t *memory, const uint16_t *pcs, size_t count, uint16_t next)
+{
+	const char	*registers = "abcxyzij";
+	unsigned int	uses = 0, gotos = 0, jumped = 0;
+	size_t		i;
+
+	for(i = 0; i < count; i++)
+		uses |= native_uses(memory[pcs[i]]);
+	fprintf(out, "static void block_%04x(DCPU_NativeFrame *f)\n{\n", pcs[0]);
+	if(uses & NATIVE_USES_MEMORY)
+		fprintf(out, "\tuint16_t *const m = f->memory;\n");
+	for(i = 0; i < DCPU_REG_COUNT; i++)
+	{
+		if(uses & (1u << i))
+			fprintf(out, "\tuint16_t r%c = f->registers[%zu];\n", registers[i], i);
+	}
+	if(uses & NATIVE_USES_SP)
+		fprintf(out, "\tuint16_t sp = f->sp;\n");
+	if(uses & NATIVE_USES_O)
+		fprintf(out, "\tuint16_t o = f->o;\n");
+	if(uses & NATIVE_USES_DUMMY)
+		fprintf(out, "\tuint16_t dm = f->dummy;\n");
+	fprintf(out, "\tuint16_t pc;\n\tuint64_t t = f->timer;\n\tunsigned int n = 0;\n\n");
+
+	for(i = 0; i < count; i++)
+	{
+		const uint16_t	inst = memory[pcs[i]];
+		unsigned int	unit_uses = native_uses(inst);
+
+		fprintf(out, "\t{\n");
+		native_emit(out, memory, pcs[i], 2, &gotos);
+		fprintf(out, "\t}\n");
+		if(native_if(inst))
+			unit_uses |= native_uses(memory[pcs[++i]]);
+		else
+			jumped = native_jumps(inst);
+		/* Hooked reads and writes may have changed what's due, so that has to be looked at right away. */
+		if(i + 1 < count && (unit_uses & NATIVE_USES_MEMORY))
+		{
+			fprintf(out, "\tif(f->exit)\n\t{\n\t\tpc = 0x%04x;\n\t\tgoto out;\n\t}\n", pcs[i + 1]);
+			gotos++;
+		}
+	}
+	if(!jumped)
+		fprintf(out, "\tpc = 0x%04x;\n", next);
+	if(gotos > 0)
+		fprintf(out, "out:\n");
+	for(i = 0; i < DCPU_REG_COUNT; i++)
+	{
+		if(uses & (1u << i))
+			fprintf(out, "\tf->registers[%zu] = r%c;\n", i, registers[i]);
+	}
+	if(uses & NATIVE_USES_SP)
+		fprintf(out, "\tf->sp = sp;\n");
+	if(uses & NATIVE_USES_O)
+		fprintf(out, "\tf->o = o;\n");
+	if(uses & NATIVE_USES_DUMMY)
+		fprintf(out, "\tf->dummy = dm;\n");
+	fprintf(out, "\tf->pc = pc;\n\tf->timer = t;\n\tf->instructions += n;\n}\n\n");
+}
+
+/** \brief Compiles the code of an instance's memory to C, ahead of time, for DCPU_RunNative().
+ *
+ * Code is found by following the flow of control from the entry points: jumps and calls to
+ * literal addresses, returns from calls, and the instructions after conditional ones. Each
+ * run of straight-line code becomes a C function, with the registers it uses in locals and
+ * its cycles counted up front. Jumps to computed addresses are looked up at run time, in a
+ * table of the blocks by address.
+ *
+ * The generated source includes cade.h, and defines a DCPU_NativeModule with the given name.
+ * It can be used with any instance that has the same code loaded; pages whose contents differ
+ * from what they were when compiled are run by the interpreter instead.
+ *
+ * \param out The file to write the C source to.
+ * \param entries The addresses to start looking for code at.
+ * \param name The name of the module in the generated code.
+ *
+ * \return The number of blocks compiled, or 0 if there were none or something failed.
+*/
+size_t DCPU_Recompile(FILE *out, const DCPU_State *cpu, const uint16_t *entries, size_t count, const char *name)
+{
+	const uint16_t	*memory = cpu->memory;
+	uint32_t	*seen = calloc(2 * MEM_SIZE / 32, sizeof *seen), *starts = seen + MEM_SIZE / 32;
+	uint32_t	code_pages[PAGE_COUNT / 32] = { 0 };
+	uint16_t	*pending = malloc(MEM_SIZE * sizeof *pending), *cycles = calloc(MEM_SIZE, sizeof *cycles);
+	uint16_t	pcs[NATIVE_BLOCK_LENGTH], next;
+	size_t		num_pending = 0, num_blocks = 0, length, i, j;
+
+	if(seen == NULL || pending == NULL || cycles == NULL)
+		goto done;
+	for(i = 0; i < count; i++)
+		native_visit(seen, pending, &num_pending, entries[i]);
+	while(num_pending > 0)
+	{
+		const uint16_t	start = pending[--num_pending];
+
+		if((length = native_scan(memory, start, pcs, &next)) == 0)
+		{
+			const uint16_t	inst = memory[start], after = start + DCPU_InstructionLength(inst);
+
+			/* Carry on past instructions that can't be compiled, but not past invalid ones. */
+			if((inst & 0xf) != OP_NOBASIC || native_jsr(inst))
+			{
+				native_visit(seen, pending, &num_pending, after);
+				if(native_if(inst))
+					native_visit(seen, pending, &num_pending, after + DCPU_InstructionLength(memory[after]));
+			}
+			continue;
+		}
+		starts[start / 32] |= 1u << (start % 32);
+		code_pages[start / PAGE_SIZE / 32] |= 1u << (start / PAGE_SIZE % 32);
+		num_blocks++;
+		for(j = 0; j < length; j++)
+		{
+			const uint16_t	inst = memory[pcs[j]];
+			uint16_t	target;
+
+			cycles[start] += native_cycles(inst) + (native_if(inst) ? 2 : 0);
+			if(native_jsr(inst))
+				native_visit(seen, pending, &num_pending, pcs[j] + DCPU_InstructionLength(inst));
+			if(native_jumps(inst) && native_target(memory, pcs[j], &target))
+				native_visit(seen, pending, &num_pending, target);
+		}
+		if(!native_jumps(memory[pcs[length - 1]]) || (length > 1 && native_if(memory[pcs[length - 2]])))
+			native_visit(seen, pending, &num_pending, next);
+	}
+	if(num_blocks == 0)
+		goto done;
+
+	fprintf(out, "/*\n * Natively compiled DCPU-16 code, generated by DCPU_Recompile(). Do not edit.\n*/\n\n");
+	fprintf(out, "#include \"cade.h\"\n\n");
+	fprintf(out, "#define\tREAD(address, cycle)\t(f->read_hooks[(address) >> 8] ? DCPU_NativeLoad(f, (address), (cycle)) : m[(address)])\n");
+	fprintf(out, "#define\tWRITE(address, value, cycle)\tdo { if(f->write_hooks[(address) >> 8]) DCPU_NativeStore(f, (address), (value), (cycle)); "
+		"else { m[(address)] = (value); f->written[(address) >> 13] |= 1u << ((address) >> 8 & 31); } } while(0)\n\n");
+	for(i = 0; i < MEM_SIZE; i++)
+	{
+		if(starts[i / 32] & (1u << (i % 32)))
+		{
+			length = native_scan(memory, i, pcs, &next);
+			native_block(out, memory, pcs, length, next);
+		}
+	}
+
+	fprintf(out, "static const DCPU_NativeBlock blocks[0x%x] = {\n", MEM_SIZE);
+	for(i = 0; i < MEM_SIZE; i++)
+	{
+		if(starts[i / 32] & (1u << (i % 32)))
+			fprintf(out, "\t[0x%04zx] = block_%04zx,\n", i, i);
+	}
+	fprintf(out, "};\n\nstatic const uint16_t cycles[0x%x] = {\n", MEM_SIZE);
+	for(i = 0; i < MEM_SIZE; i++)
+	{
+		if(starts[i / 32] & (1u << (i % 32)))
+			fprintf(out, "\t[0x%04zx] = %u,\n", i, cycles[i]);
+	}
+	fprintf(out, "};\n\nstatic const uint64_t page_hashes[%u] = {\n", PAGE_COUNT);
+	for(i = 0; i < PAGE_COUNT; i++)
+	{
+		if(code_pages[i / 32] & (1u << (i % 32)))
+			fprintf(out, "\t[0x%02zx] = 0x%016" PRIx64 "ull,\n", i, page_digest(memory, i));
+	}
+	fprintf(out, "};\n\nstatic const uint32_t code_pages[%u] = {", PAGE_COUNT / 32);
+	for(i = 0; i < PAGE_COUNT / 32; i++)
+		fprintf(out, "%s0x%08" PRIx32, i > 0 ? ", " : " ", code_pages[i]);
+	fprintf(out, " };\n\nconst DCPU_NativeModule %s = { blocks, cycles, page_hashes, code_pages };\n", name);
+	if(ferror(out))
+		num_blocks = 0;
+done:
+	free(cycles);
+	free(pending);
+	free(seen);
+
+	return num_blocks;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/** \brief The clock rate of the DCPU-16, in cycles per second. */
+#define	CLOCK_RATE	100000
+
+/** \brief A device attached to an instance. */
+struct DCPU_Device {
+	DCPU_State		*cpu;			/**< The instance the device is attached to. */
+	const DCPU_DeviceClass	*type;			/**< What kind of device this is. */
+	void			*data;			/**< The device's own state. */
+	uint16_t		address, length;	/**< The range of memory the device is mapped into. */
+	uint64_t		synced;			/**< The cycle the device has been brought up to date to. */
+	uint64_t		due;			/**< The cycle of the device's scheduled event. */
+	int			scheduled;		/**< Set if the device has an event scheduled. */
+	DCPU_Device		*next, **prev;		/**< Links in the list of its timer wheel slot. */
+	DCPU_Device		*next_device;		/**< The next device attached to the same instance. */
+};
+
+/* Returns the cycle of a wheel's next wake-up: when the earliest device in level 0 is due, or
+ * else when the earliest slot of the lowest occupied level starts, which is as early as any
+ * device in it can be due.
+*/
+static uint64_t wheel_next(const Wheel *wheel)
+{
+	size_t	level;
+
+	for(level = 0; level < WHEEL_LEVELS; level++)
+	{
+		if(wheel->occupied[level] != 0)
+		{
+			const unsigned int	shift = WHEEL_BITS * level;
+			const uint64_t		above = shift + WHEEL_BITS < 64 ? ~0ull << (shift + WHEEL_BITS) : 0;
+
+			return (wheel->now & above) | (uint64_t) __builtin_ctzll(wheel->occupied[level]) << shift;
+		}
+	}
+	return UINT64_MAX;
+}
+
+/* Puts a device in the slot for its due cycle. */
+static void wheel_insert(Wheel *wheel, DCPU_Device *device)
+{
+	const uint64_t	due = device->due > wheel->now ? device->due : wheel->now;
+	const size_t	level = due != wheel->now ? (63 - __builtin_clzll(due ^ wheel->now)) / WHEEL_BITS : 0;
+	const size_t	slot = (due >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+	DCPU_Device	**head = &wheel->slots[level][slot];
+
+	if((device->next = *head) != NULL)
+		device->next->prev = &device->next;
+	device->prev = head;
+	*head = device;
+	wheel->occupied[level] |= 1ull << slot;
+}
+
+/* Takes a device out of its slot. */
+static void wheel_remove(Wheel *wheel, DCPU_Device *device)
+{
+	DCPU_Device	**slots = &wheel->slots[0][0];
+
+	if((*device->prev = device->next) != NULL)
+		device->next->prev = device->prev;
+	/* If the device was first in its slot with none after it, the slot is now empty. */
+	else if(device->prev >= slots && device->prev < slots + WHEEL_LEVELS * WHEEL_SLOTS)
+		wheel->occupied[(device->prev - slots) / WHEEL_SLOTS] &= ~(1ull << (device->prev - slots) % WHEEL_SLOTS);
+}
+
+/* Brings a device up to date with a cycle. */
+static void device_sync(DCPU_Device *device, uint64_t timer)
+{
+	if(timer <= device->synced)
+		return;
+	if(device->type->sync != NULL)
+		device->type->sync(device, device->synced, timer);
+	device->synced = timer;
+}
+
+/* Runs the events of all devices that are due, cascading slots of higher levels down as
+ * their time comes, and then advances the wheel to the current cycle.
+*/
+static void wheel_run(DCPU_State *cpu)
+{
+	Wheel		*wheel = &cpu->wheel;
+	uint64_t	next;
+
+	while((next = wheel_next(wheel)) <= cpu->timer)
+	{
+		size_t		level, slot;
+		DCPU_Device	*device;
+
+		for(level = 0; wheel->occupied[level] == 0; level++)
+			;
+		slot = __builtin_ctzll(wheel->occupied[level]);
+		wheel->now = next;
+		/* Devices are taken out one at a time, since events may reschedule any device. */
+		while((device = wheel->slots[level][slot]) != NULL)
+		{
+			wheel_remove(wheel, device);
+			if(level > 0)
+				wheel_insert(wheel, device);
+			else
+			{
+				device->scheduled = 0;
+				device_sync(device, device->due);
+				device->type->event(device);
+			}
+		}
+	}
+	wheel->now = cpu->timer;
+}
+
+/* Brings devices mapped at an address up to date, before the CPU reads it. */
+static void device_read(DCPU_State *cpu, uint16_t address)
+{
+	DCPU_Device	*device;
+
+	for(device = cpu->devices; device != NULL; device = device->next_device)
+	{
+		if((uint16_t) (address - device->address) < device->length)
+			device_sync(device, cpu->timer);
+	}
+}
+
+/* Lets devices mapped at an address know that the CPU has written to it. */
+static void device_written(DCPU_State *cpu, uint16_t address, uint16_t value)
+{
+	DCPU_Device	*device;
+
+	for(device = cpu->devices; device != NULL; device = device->next_device)
+	{
+		if((uint16_t) (address - device->address) < device->length)
+		{
+			device_sync(device, cpu->timer);
+			if(device->type->write != NULL)
+				device->type->write(device, address - device->address, value);
+		}
+	}
+}
+
+/* Adds or removes a device's range of memory from the counts of devices mapped into each page. */
+static void device_map(DCPU_Device *device, int delta)
+{
+	const size_t	pages = (device->address % PAGE_SIZE + device->length + PAGE_SIZE - 1) / PAGE_SIZE;
+	size_t		i;
+
+	for(i = 0; i < pages && i < PAGE_COUNT; i++)
+		device->cpu->device_pages[(device->address / PAGE_SIZE + i) % PAGE_COUNT] += delta;
+}
+
+/** \brief Attaches a device to an instance.
+ *
+ * Devices are emulated lazily: rather than on every cycle, a device is only run when it has
+ * to be. That is when the CPU reads or writes the memory it's mapped into, in which case
+ * it's synchronized up to the current cycle first, and when an event it has scheduled with
+ * DCPU_DeviceSchedule() comes due. Events are kept in a timer wheel, so that the CPU only
+ * ever has to compare its cycle counter with that of the next event, however many devices
+ * there are.
+ *
+ * Devices are not part of the execution history, or of save-states.
+ *
+ * \param type The callbacks that implement the device, which must outlive it.
+ * \param address The first address of the range of memory the device is mapped into.
+ * \param length The length of the range, which may be 0 for a device that isn't mapped.
+ * \param data The device's own state, returned by DCPU_DeviceGetData().
+ *
+ * \return The new device, or \c NULL on failure.
+*/
+DCPU_Device * DCPU_DeviceCreate(DCPU_State *cpu, const DCPU_DeviceClass *type, uint16_t address, uint16_t length, void *data)
+{
+	DCPU_Device	*device;
+
+	if((device = calloc(1, sizeof *device)) == NULL)
+		return NULL;
+	device->cpu = cpu;
+	device->type = type;
+	device->data = data;
+	device->address = address;
+	device->length = length;
+	device->synced = cpu->timer;
+	device_map(device, 1);
+	device->next_device = cpu->devices;
+	cpu->devices = device;
+
+	return device;
+}
+
+/** \brief Detaches a device from its instance, and destroys it.
+ *
+ * The device's \c destroy callback, if any, is called first, to free its own state.
+*/
+void DCPU_DeviceDestroy(DCPU_Device *device)
+{
+	DCPU_Device	**link;
+
+	if(device == NULL)
+		return;
+	if(device->type->destroy != NULL)
+		device->type->destroy(device);
+	for(link = &device->cpu->devices; *link != NULL; link = &(*link)->next_device)
+	{
+		if(*link == device)
+		{
+			*link = device->next_device;
+			device_map(device, -1);
+			if(device->scheduled)
+			{
+				wheel_remove(&device->cpu->wheel, device);
+				schedule_events(device->cpu);
+			}
+			break;
+		}
+	}
+	free(device);
+}
+
+/** \brief Returns the state that a device was created with. */
+void * DCPU_DeviceGetData(const DCPU_Device *device)
+{
+	return device->data;
+}
+
+/** \brief Returns the cycle that a device has been brought up to date to.
+ *
+ * During the device's callbacks, this is the cycle the CPU or the scheduled event is at.
+*/
+uint64_t DCPU_DeviceGetTime(const DCPU_Device *device)
+{
+	return device->synced;
+}
+
+/** \brief Schedules a device's \c event callback to be called at a cycle.
+ *
+ * A device has at most one scheduled event; this replaces any earlier one. The device is
+ * brought up to date with the cycle before the callback is called.
+ *
+ * \param timer The cycle to call the callback at. Cycles that have already passed mean as
+ *        soon as possible.
+*/
+void DCPU_DeviceSchedule(DCPU_Device *device, uint64_t timer)
+{
+	DCPU_State	*cpu = device->cpu;
+
+	if(device->scheduled)
+		wheel_remove(&cpu->wheel, device);
+	device->due = timer;
+	device->scheduled = 1;
+	if(wheel_next(&cpu->wheel) == UINT64_MAX)
+		cpu->wheel.now = cpu->timer;
+	wheel_insert(&cpu->wheel, device);
+	schedule_events(cpu);
+}
+
+/** \brief Cancels a device's scheduled event, if it has one. */
+void DCPU_DeviceCancel(DCPU_Device *device)
+{
+	if(!device->scheduled)
+		return;
+	wheel_remove(&device->cpu->wheel, device);
+	device->scheduled = 0;
+	schedule_events(device->cpu);
+}
+
+/** \brief Reads a word of the memory a device is mapped into.
+ *
+ * \param offset The offset of the word from the start of the device's range.
+*/
+uint16_t DCPU_DeviceLoad(const DCPU_Device *device, uint16_t offset)
+{
+	return device->cpu->memory[(uint16_t) (device->address + offset)];
+}
+
+/** \brief Writes a word of the memory a device is mapped into, as the device.
+ *
+ * This doesn't call the device's \c write callback.
+ *
+ * \param offset The offset of the word from the start of the device's range.
+ * \param value The value to write.
+*/
+void DCPU_DeviceStore(DCPU_Device *device, uint16_t offset, uint16_t value)
+{
+	const uint16_t	address = device->address + offset;
+	uint16_t	*target = &device->cpu->memory[address];
+	const uint16_t	old = *target;
+
+	*target = value;
+	memory_written(device->cpu, address, old, value);
+}
+
+/* The registers of the clock device, as offsets from its address. */
+enum {
+	CLOCK_DIVIDER = 0,
+	CLOCK_TICKS,
+	CLOCK_ALARM,
+	CLOCK_FLAG,
+	CLOCK_LENGTH
+};
+
+/** \brief State of a clock device. */
+typedef struct {
+	uint64_t	start;				/**< The cycle the clock was last started at. */
+	uint16_t	divider;			/**< The clock ticks at 60 / divider Hz, or not at all if 0. */
+} Clock;
+
+/* Returns the number of ticks the clock has counted at a cycle. */
+static uint64_t clock_ticks(const Clock *clock, uint64_t timer)
+{
+	return (timer - clock->start) * 60 / ((uint64_t) CLOCK_RATE * clock->divider);
+}
+
+/* Returns the cycle at which the clock has counted a number of ticks. */
+static uint64_t clock_cycle(const Clock *clock, uint64_t ticks)
+{
+	return clock->start + (ticks * CLOCK_RATE * clock->divider + 59) / 60;
+}
+
+static void clock_sync(DCPU_Device *device, uint64_t from, uint64_t to)
+{
+	const Clock	*clock = DCPU_DeviceGetData(device);
+	uint16_t	ticks;
+
+	if(clock->divider == 0)
+		return;
+	ticks = clock_ticks(clock, to);
+	if(DCPU_DeviceLoad(device, CLOCK_TICKS) != ticks)
+		DCPU_DeviceStore(device, CLOCK_TICKS, ticks);
+}
+
+/* Schedules the alarm for the next time the tick count gets to the alarm register. */
+static void clock_schedule(DCPU_Device *device)
+{
+	const Clock	*clock = DCPU_DeviceGetData(device);
+	const uint16_t	alarm = DCPU_DeviceLoad(device, CLOCK_ALARM);
+	uint64_t	ticks;
+
+	if(clock->divider == 0 || alarm == 0)
+	{
+		DCPU_DeviceCancel(device);
+		return;
+	}
+	/* The tick count wraps around, so find the next tick after this one where it's right. */
+	ticks = clock_ticks(clock, DCPU_DeviceGetTime(device));
+	DCPU_DeviceSchedule(device, clock_cycle(clock, ticks + (uint16_t) (alarm - ticks - 1) + 1));
+}
+
+static void clock_write(DCPU_Device *device, uint16_t offset, uint16_t value)
+{
+	Clock	*clock = DCPU_DeviceGetData(device);
+
+	if(offset == CLOCK_DIVIDER)
+	{
+		clock->start = DCPU_DeviceGetTime(device);
+		clock->divider = value;
+		DCPU_DeviceStore(device, CLOCK_TICKS, 0);
+	}
+	if(offset == CLOCK_DIVIDER || offset == CLOCK_ALARM)
+		clock_schedule(device);
+}
+
+static void clock_event(DCPU_Device *device)
+{
+	DCPU_DeviceStore(device, CLOCK_FLAG, 1);
+	clock_schedule(device);
+}
+
+static void clock_destroy(DCPU_Device *device)
+{
+	free(DCPU_DeviceGetData(device));
+}
+
+static const DCPU_DeviceClass	clock_class = { "clock", clock_sync, clock_write, clock_event, clock_destroy };
+
+/** \brief Attaches a generic clock device to an instance.
+ *
+ * The clock is mapped into four words of memory:
+ * - Writing N to the first word starts the clock ticking at 60 / N Hz, with the CPU running
+ *   at 100 kHz, or stops it if N is 0. Either way, the tick count is reset.
+ * - The second word holds the number of ticks since the clock was started.
+ * - Writing a tick count to the third word sets an alarm for when the clock reaches it, or
+ *   clears the alarm if it's 0.
+ * - The clock writes 1 to the fourth word when the alarm goes off. The guest can write 0 to
+ *   it to acknowledge the alarm.
+ *
+ * This is also the reference for how to implement devices: the tick count is only worked
+ * out when the guest reads it, and the alarm is an event at the exact cycle it goes off.
+ *
+ * \param address The first of the clock's four words of memory.
+ *
+ * \return The new device, to destroy with DCPU_DeviceDestroy(), or \c NULL on failure.
+*/
+DCPU_Device * DCPU_ClockCreate(DCPU_State *cpu, uint16_t address)
+{
+	Clock		*clock;
+	DCPU_Device	*device;
+
+	if((clock = calloc(1, sizeof *clock)) == NULL)
+		return NULL;
+	if((device = DCPU_DeviceCreate(cpu, &clock_class, address, CLOCK_LENGTH, clock)) == NULL)
+		free(clock);
+	return device;
+}
+
+/* The registers of the disk device, as offsets from its address. */
+enum {
+	DISK_COMMAND = 0,
+	DISK_SECTOR,
+	DISK_ADDRESS,
+	DISK_STATE,
+	DISK_ERROR,
+	DISK_LENGTH
+};
+
+/* Commands, states and error codes of the disk device, numbered as with the M35FD. */
+enum { DISK_COMMAND_NONE = 0, DISK_COMMAND_READ, DISK_COMMAND_WRITE };
+enum { DISK_STATE_READY = 1, DISK_STATE_READY_WP, DISK_STATE_BUSY };
+enum { DISK_ERROR_NONE = 0, DISK_ERROR_BUSY, DISK_ERROR_PROTECTED = 3, DISK_ERROR_BAD_SECTOR = 5 };
+
+/** \brief Number of words in a sector of a disk. */
+#define	DISK_SECTOR_WORDS	512
+
+/** \brief Number of sectors per track of a disk, which the head has to seek between. */
+#define	DISK_TRACK_SECTORS	18
+
+/** \brief Cycles to seek the head by one track, 2.4 ms as with the M35FD. */
+#define	DISK_SEEK_CYCLES	240
+
+/** \brief Cycles to transfer a sector, at 30700 words per second as with the M35FD. */
+#define	DISK_TRANSFER_CYCLES	(DISK_SECTOR_WORDS * CLOCK_RATE / 30700)
+
+/** \brief Cycles to put a transfer off by while the host is still reading its sector in. */
+#define	DISK_RETRY_CYCLES	100
+
+/** \brief State of a disk device. */
+typedef struct {
+	uint8_t		*data;				/**< The mapped disk image. */
+	size_t		sectors;			/**< Number of sectors in the image. */
+	size_t		page_size;			/**< The host's page size, for checking whether a sector is in memory. */
+	int		swap;				/**< Set if the image's words need their bytes swapped. */
+	int		writable;			/**< Set unless the disk is write-protected. */
+	uint16_t	track;				/**< The track the head is over. */
+	uint16_t	command, sector, address;	/**< The transfer in progress, as the guest issued it. */
+	pthread_t	reader;				/**< Thread reading a sector in, when reading is set. */
+	int		reading;			/**< Set while there is a reader thread to join. */
+	uint16_t	read_sector;			/**< The sector the reader thread reads in. */
+	atomic_int	read_done;			/**< Set by the reader thread once its sector is in memory. */
+} Disk;
+
+/* Returns the host page that holds a sector of a disk's image. */
+static void * disk_page(const Disk *disk, uint16_t sector)
+{
+	return disk->data + ((size_t) sector * 2 * DISK_SECTOR_WORDS & ~(disk->page_size - 1));
+}
+
+/* Reads a sector's page in, ahead of the transfer that needs it. Faulting it in is what
+ * blocks, so this is done on a thread of its own.
+*/
+static void * disk_read_in(void *data)
+{
+	Disk			*disk = data;
+	const volatile uint8_t	*page = disk_page(disk, disk->read_sector);
+
+	(void) *page;
+	atomic_store_explicit(&disk->read_done, 1, memory_order_release);
+
+	return NULL;
+}
+
+/* Starts a thread reading in the sector of the transfer in progress, unless one is still busy
+ * with an earlier sector, which is then left to finish first.
+*/
+static void disk_read_start(Disk *disk)
+{
+	if(disk->reading)
+	{
+		if(!atomic_load_explicit(&disk->read_done, memory_order_acquire))
+			return;
+		pthread_join(disk->reader, NULL);
+	}
+	disk->read_sector = disk->sector;
+	atomic_store_explicit(&disk->read_done, 0, memory_order_relaxed);
+	disk->reading = pthread_create(&disk->reader, NULL, disk_read_in, disk) == 0;
+}
+
+static uint16_t disk_ready(const Disk *disk)
+{
+	return disk->writable ? DISK_STATE_READY : DISK_STATE_READY_WP;
+}
+
+/* Ends a command, with the result in the error register. Clearing the command register is
+ * what tells the guest the disk is done.
+*/
+static void disk_finish(DCPU_Device *device, uint16_t error)
+{
+	DCPU_DeviceStore(device, DISK_STATE, disk_ready(DCPU_DeviceGetData(device)));
+	DCPU_DeviceStore(device, DISK_ERROR, error);
+	DCPU_DeviceStore(device, DISK_COMMAND, DISK_COMMAND_NONE);
+}
+
+static void disk_write(DCPU_Device *device, uint16_t offset, uint16_t value)
+{
+	Disk		*disk = DCPU_DeviceGetData(device);
+	uint16_t	track;
+
+	if(offset != DISK_COMMAND || value == DISK_COMMAND_NONE)
+		return;
+	if(DCPU_DeviceLoad(device, DISK_STATE) == DISK_STATE_BUSY)
+	{
+		/* Leave the transfer in progress alone, but let the guest know it has to wait. */
+		DCPU_DeviceStore(device, DISK_COMMAND, disk->command);
+		DCPU_DeviceStore(device, DISK_ERROR, DISK_ERROR_BUSY);
+		return;
+	}
+	disk->sector = DCPU_DeviceLoad(device, DISK_SECTOR);
+	if(value != DISK_COMMAND_READ && value != DISK_COMMAND_WRITE)
+		DCPU_DeviceStore(device, DISK_COMMAND, DISK_COMMAND_NONE);
+	else if(disk->sector >= disk->sectors)
+		disk_finish(device, DISK_ERROR_BAD_SECTOR);
+	else if(value == DISK_COMMAND_WRITE && !disk->writable)
+		disk_finish(device, DISK_ERROR_PROTECTED);
+	else
+	{
+		disk->command = value;
+		disk->address = DCPU_DeviceLoad(device, DISK_ADDRESS);
+		DCPU_DeviceStore(device, DISK_STATE, DISK_STATE_BUSY);
+		DCPU_DeviceStore(device, DISK_ERROR, DISK_ERROR_NONE);
+		/* Have the host start reading the sector in now, while the emulated disk seeks. */
+		madvise(disk_page(disk, disk->sector), disk->page_size, MADV_WILLNEED);
+		disk_read_start(disk);
+		track = disk->sector / DISK_TRACK_SECTORS;
+		DCPU_DeviceSchedule(device, DCPU_DeviceGetTime(device) + (uint64_t) DISK_SEEK_CYCLES * (track > disk->track ? track - disk->track : disk->track - track) + DISK_TRANSFER_CYCLES);
+		disk->track = track;
+	}
+}
+
+static void disk_event(DCPU_Device *device)
+{
+	Disk		*disk = DCPU_DeviceGetData(device);
+	DCPU_State	*cpu = device->cpu;
+	uint8_t		*data = disk->data + (size_t) disk->sector * 2 * DISK_SECTOR_WORDS;
+	unsigned char	resident = 1;
+	size_t		first;
+
+	/* Touching a sector that isn't in memory yet would block, so the transfer waits for the
+	 * reader thread instead, which is started again if it couldn't be before.
+	*/
+	if(disk->reading && disk->read_sector == disk->sector && atomic_load_explicit(&disk->read_done, memory_order_acquire))
+	{
+		pthread_join(disk->reader, NULL);
+		disk->reading = 0;
+	}
+	else if(mincore(disk_page(disk, disk->sector), disk->page_size, &resident) == 0 && (resident & 1) == 0)
+	{
+		madvise(disk_page(disk, disk->sector), disk->page_size, MADV_WILLNEED);
+		if(!disk->reading || disk->read_sector != disk->sector)
+			disk_read_start(disk);
+		DCPU_DeviceSchedule(device, DCPU_DeviceGetTime(device) + DISK_RETRY_CYCLES);
+		return;
+	}
+	if(disk->command == DISK_COMMAND_READ)
+		load_words(cpu, disk->address, data, DISK_SECTOR_WORDS, disk->swap);
+	else
+	{
+		first = MEM_SIZE - disk->address < DISK_SECTOR_WORDS ? MEM_SIZE - disk->address : DISK_SECTOR_WORDS;
+		copy_words((uint16_t *) data, (const uint8_t *) (cpu->memory + disk->address), first, disk->swap);
+		copy_words((uint16_t *) data + first, (const uint8_t *) cpu->memory, DISK_SECTOR_WORDS - first, disk->swap);
+	}
+	disk_finish(device, DISK_ERROR_NONE);
+}
+
+static void disk_destroy(DCPU_Device *device)
+{
+	Disk	*disk = DCPU_DeviceGetData(device);
+
+	if(disk->reading)
+		pthread_join(disk->reader, NULL);
+	munmap(disk->data, disk->sectors * 2 * DISK_SECTOR_WORDS);
+	free(disk);
+}
+
+static const DCPU_DeviceClass	disk_class = { "disk", NULL, disk_write, disk_event, disk_destroy };
+
+/** \brief Attaches a disk device to an instance, in the style of the M35FD, backed by an image file.
+ *
+ * The disk has sectors of 512 words, 18 to a track, and takes as long as the M35FD to seek
+ * and to transfer them. It's mapped into five words of memory:
+ * - Writing 1 to the first word reads a sector into memory, and writing 2 writes a sector
+ *   from memory. The disk clears it once the transfer is complete.
+ * - The second word is the sector to transfer.
+ * - The third word is the address of the sector's 512 words in memory.
+ * - The disk keeps its state in the fourth word: 1 if ready, 2 if ready but write-protected,
+ *   and 3 while busy with a transfer.
+ * - The disk sets the fifth word to the result of the last command: 0 on success, 1 if it
+ *   was still busy, 3 if it's write-protected and 5 if there's no such sector.
+ *
+ * Transfers are done as DMA, at the cycle they complete. The image file is mapped into
+ * memory rather than read, and the host is asked to read a sector in as soon as the guest
+ * issues a command for it, by a thread of its own. If it still hasn't by the time the
+ * transfer completes, the transfer is put off rather than have the emulation wait for the
+ * host. Writes go to the image file as the host writes its pages back.
+ *
+ * That makes the disk's timing depend on the host's page cache, so unlike everything else,
+ * it isn't deterministic: two runs of the same guest may see a transfer complete at
+ * different cycles, and end up with different state hashes, or repeat differently.
+ *
+ * \param address The first of the disk's five words of memory.
+ * \param filename The image file, which is a whole number of sectors of raw words, with no header.
+ * \param format The byte order of the words in the file, which are big-endian unless this is
+ *        \c DCPU_IMAGE_LITTLE_ENDIAN.
+ * \param read_only Non-zero to write-protect the disk, and only open the file for reading.
+ *
+ * \return The new device, to destroy with DCPU_DeviceDestroy(), or \c NULL on failure,
+ *         including if the file doesn't hold a single sector.
+*/
+DCPU_Device * DCPU_DiskCreate(DCPU_State *cpu, uint16_t address, const char *filename, DCPU_ImageFormat format, int read_only)
+{
+	struct stat	st;
+	Disk		*disk;
+	DCPU_Device	*device;
+	int		fd;
+
+	if((disk = calloc(1, sizeof *disk)) == NULL)
+		return NULL;
+	if((fd = open(filename, read_only ? O_RDONLY : O_RDWR)) < 0)
+	{
+		free(disk);
+		return NULL;
+	}
+	if(fstat(fd, &st) == 0)
+		disk->sectors = st.st_size / (2 * DISK_SECTOR_WORDS);
+	if(disk->sectors > 0x10000)
+		disk->sectors = 0x10000;
+	if(disk->sectors > 0)
+		disk->data = mmap(NULL, disk->sectors * 2 * DISK_SECTOR_WORDS, read_only ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(disk->sectors == 0 || disk->data == MAP_FAILED)
+	{
+		free(disk);
+		return NULL;
+	}
+	disk->page_size = sysconf(_SC_PAGESIZE);
+	disk->swap = (format == DCPU_IMAGE_LITTLE_ENDIAN) == host_is_big_endian();
+	disk->writable = !read_only;
+	if((device = DCPU_DeviceCreate(cpu, &disk_class, address, DISK_LENGTH, disk)) == NULL)
+	{
+		munmap(disk->data, disk->sectors * 2 * DISK_SECTOR_WORDS);
+		free(disk);
+		return NULL;
+	}
+	disk_finish(device, DISK_ERROR_NONE);
+
+	return device;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/** \brief How many cycles apart checkpoints are taken at first. */
+#define	HISTORY_INTERVAL	0x1000
+
+/** \brief How far apart checkpoints are thinned out to at most, before the oldest are dropped instead. */
+#define	HISTORY_MAX_INTERVAL	0x100000
+
+/** \brief Smallest limit on the memory used by checkpoints: all of memory for the oldest one, and 4 KiB for the rest. */
+#define	HISTORY_MIN_BYTES	((MEM_SIZE + 8 * PAGE_SIZE) * sizeof(uint16_t))
+
+/** \brief A checkpoint in an execution history. */
+typedef struct {
+	Registers	registers;			/**< Registers and pipeline state at the checkpoint. */
+	uint32_t	pages[PAGE_COUNT / 32];		/**< Bitmap of pages written since the previous checkpoint. */
+	uint16_t	*memory;			/**< Contents of those pages at the checkpoint, in order. */
+	int		barrier;			/**< Set if the host changed the state here, so it can't be replayed across. */
+} Checkpoint;
+
+/** \brief Execution history of an instance, kept as checkpoints to restore and replay from. */
+struct DCPU_History {
+	DCPU_State	*cpu;				/**< The instance the history belongs to. */
+	size_t		max_bytes;			/**< Limit on the memory used by checkpoints. */
+	size_t		bytes;				/**< Memory used by checkpoints. */
+	uint64_t	interval;			/**< Cycles between checkpoints. */
+	Checkpoint	*checkpoints;			/**< The checkpoints, oldest first. The oldest has all pages. */
+	size_t		count, alloc;			/**< Number of checkpoints in, and allocated for, the array. */
+	size_t		current;			/**< Index of the latest checkpoint at or before the CPU's timer. */
+};
+
+static size_t page_count(const uint32_t *pages)
+{
+	size_t	i, count = 0;
+
+	for(i = 0; i < PAGE_COUNT / 32; i++)
+		count += __builtin_popcount(pages[i]);
+	return count;
+}
+
+static size_t checkpoint_bytes(const Checkpoint *checkpoint)
+{
+	return sizeof *checkpoint + page_count(checkpoint->pages) * PAGE_SIZE * sizeof *checkpoint->memory;
+}
+
+/* Returns the contents of a page saved in a checkpoint, or NULL if it isn't in there. */
+static const uint16_t * checkpoint_page(const Checkpoint *checkpoint, size_t page)
+{
+	const uint32_t	bit = 1u << (page % 32);
+	size_t		i, index = 0;
+
+	if((checkpoint->pages[page / 32] & bit) == 0)
+		return NULL;
+	for(i = 0; i < page / 32; i++)
+		index += __builtin_popcount(checkpoint->pages[i]);
+	index += __builtin_popcount(checkpoint->pages[page / 32] & (bit - 1));
+
+	return checkpoint->memory + index * PAGE_SIZE;
+}
+
+/* Merges a checkpoint into the one after it, which then covers everything written since the one
+ * before. Pages are taken from the later checkpoint where it has them. Returns 0 on failure.
+*/
+static int checkpoint_merge(DCPU_History *history, Checkpoint *into, Checkpoint *from)
+{
+	uint32_t	pages[PAGE_COUNT / 32];
+	uint16_t	*memory = NULL;
+	size_t		i, page, count;
+
+	for(i = 0; i < PAGE_COUNT / 32; i++)
+		pages[i] = into->pages[i] | from->pages[i];
+	if((count = page_count(pages)) > 0 && (memory = malloc(count * PAGE_SIZE * sizeof *memory)) == NULL)
+		return 0;
+	for(page = 0, i = 0; page < PAGE_COUNT; page++)
+	{
+		const uint16_t	*source = checkpoint_page(into, page);
+
+		if(source == NULL && (source = checkpoint_page(from, page)) == NULL)
+			continue;
+		memcpy(memory + i++ * PAGE_SIZE, source, PAGE_SIZE * sizeof *memory);
+	}
+	history->bytes -= checkpoint_bytes(into) + checkpoint_bytes(from);
+	free(into->memory);
+	free(from->memory);
+	memcpy(into->pages, pages, sizeof pages);
+	into->memory = memory;
+	into->barrier |= from->barrier;
+	history->bytes += checkpoint_bytes(into);
+
+	return 1;
+}
+
+/* Keeps the memory used by checkpoints within the limit. Checkpoints are thinned out first, so
+ * that the history keeps reaching back as far; when they are as far apart as they should get,
+ * the oldest are dropped instead.
+*/
+static void history_trim(DCPU_History *history)
+{
+	Checkpoint	*checkpoints = history->checkpoints;
+
+	while(history->bytes > history->max_bytes && history->count > 1)
+	{
+		if(history->count > 2 && history->interval < HISTORY_MAX_INTERVAL)
+		{
+			size_t	i, kept = 1;
+
+			/* Drop every other checkpoint, but never the latest one, or one the host changed the state at. */
+			for(i = 1; i < history->count; i++)
+			{
+				if(i % 2 == 1 && i + 1 < history->count && !checkpoints[i].barrier &&
+				   checkpoint_merge(history, &checkpoints[i + 1], &checkpoints[i]))
+					continue;
+				checkpoints[kept++] = checkpoints[i];
+			}
+			history->count = kept;
+			history->interval *= 2;
+		}
+		else
+		{
+			/* The oldest checkpoint has all pages, so the next one can simply be copied over it. */
+			Checkpoint	*oldest = &checkpoints[0], *next = &checkpoints[1];
+			size_t		page;
+
+			for(page = 0; page < PAGE_COUNT; page++)
+			{
+				const uint16_t	*source = checkpoint_page(next, page);
+
+				if(source != NULL)
+					memcpy(oldest->memory + page * PAGE_SIZE, source, PAGE_SIZE * sizeof *source);
+			}
+			oldest->registers = next->registers;
+			history->bytes -= checkpoint_bytes(next);
+			free(next->memory);
+			memmove(next, next + 1, (history->count - 2) * sizeof *next);
+			history->count--;
+		}
+		history->current = history->count - 1;
+	}
+}
+
+/* Takes a checkpoint of the CPU's current state, after the latest one. Returns 0 on failure. */
+static int history_checkpoint(DCPU_State *cpu, int barrier)
+{
+	DCPU_History	*history = cpu->history;
+	Checkpoint	*checkpoint;
+	size_t		i, count;
+
+	if(history->count == history->alloc)
+	{
+		const size_t	alloc = history->alloc > 0 ? 2 * history->alloc : 16;
+		Checkpoint	*checkpoints;
+
+		if((checkpoints = realloc(history->checkpoints, alloc * sizeof *checkpoints)) == NULL)
+			return 0;
+		history->checkpoints = checkpoints;
+		history->alloc = alloc;
+	}
+	checkpoint = &history->checkpoints[history->count];
+	memcpy(checkpoint->pages, cpu->dirty, sizeof checkpoint->pages);
+	if(history->count == 0)
+		memset(checkpoint->pages, 0xff, sizeof checkpoint->pages);
+	checkpoint->memory = NULL;
+	if((count = page_count(checkpoint->pages)) > 0 && (checkpoint->memory = malloc(count * PAGE_SIZE * sizeof *checkpoint->memory)) == NULL)
+		return 0;
+	for(i = 0, count = 0; i < PAGE_COUNT; i++)
+	{
+		if(checkpoint->pages[i / 32] & (1u << (i % 32)))
+			memcpy(checkpoint->memory + count++ * PAGE_SIZE, cpu->memory + i * PAGE_SIZE, PAGE_SIZE * sizeof *cpu->memory);
+	}
+	registers_save(cpu, &checkpoint->registers);
+	checkpoint->barrier = barrier;
+	memset(cpu->dirty, 0, sizeof cpu->dirty);
+	history->bytes += checkpoint_bytes(checkpoint);
+	history->current = history->count++;
+	history_trim(history);
+
+	return 1;
+}
+
+/* Returns the index of the latest checkpoint at or before a cycle, which must not be before the oldest. */
+static size_t history_find(const DCPU_History *history, uint64_t timer)
+{
+	size_t	low = 0, high = history->count;
+
+	while(high - low > 1)
+	{
+		const size_t	middle = low + (high - low) / 2;
+
+		if(history->checkpoints[middle].registers.timer <= timer)
+			low = middle;
+		else
+			high = middle;
+	}
+	return low;
+}
+
+/* Returns the cycle at which the history next needs to do something. */
+static uint64_t history_next(const DCPU_History *history)
+{
+	if(history->current + 1 < history->count)
+		return history->checkpoints[history->current + 1].registers.timer;
+	return history->checkpoints[history->current].registers.timer + history->interval;
+}
+
+/* Restores the CPU to a checkpoint. Only pages written since the nearer of the checkpoint and the
+ * CPU's latest one need to be copied, from the latest checkpoint at or before it that has them.
+*/
+static void history_restore(DCPU_State *cpu, size_t index)
+{
+	DCPU_History	*history = cpu->history;
+	const size_t	first = index < history->current ? index : history->current;
+	const size_t	last = index < history->current ? history->current : index;
+	uint32_t	pages[PAGE_COUNT / 32];
+	size_t		i, j;
+
+	memcpy(pages, cpu->dirty, sizeof pages);
+	for(j = first + 1; j <= last; j++)
+	{
+		for(i = 0; i < PAGE_COUNT / 32; i++)
+			pages[i] |= history->checkpoints[j].pages[i];
+	}
+	for(i = 0; i < PAGE_COUNT / 32; i++)
+	{
+		while(pages[i] != 0)
+		{
+			const unsigned int	bit = __builtin_ctz(pages[i]);
+			const size_t		page = 32 * i + bit;
+			const uint16_t		*source;
+
+			for(j = index; (source = checkpoint_page(&history->checkpoints[j], page)) == NULL; j--)
+				;
+			memcpy(cpu->memory + page * PAGE_SIZE, source, PAGE_SIZE * sizeof *source);
+			cpu->hash_stale[i] |= 1u << bit;
+			if(cpu->display != NULL)
+				display_changed(cpu->display, page * PAGE_SIZE, PAGE_SIZE);
+			pages[i] &= ~(1u << bit);
+		}
+	}
+	memset(cpu->dirty, 0, sizeof cpu->dirty);
+	registers_load(cpu, &history->checkpoints[index].registers);
+	history->current = index;
+	schedule_events(cpu);
+}
+
+/* Called when the CPU reaches the cycle given by history_next(). */
+static void history_event(DCPU_State *cpu)
+{
+	DCPU_History	*history = cpu->history;
+
+	if(history->current + 1 < history->count)
+	{
+		/* Catching up with checkpoints taken before stepping back. Restoring the checkpoint makes
+		 * no difference, except where the host changed the state, which is replayed this way.
+		*/
+		history_restore(cpu, history_find(history, cpu->timer));
+	}
+	else
+		history_checkpoint(cpu, 0);
+}
+
+/* Called when the host has changed the state of the CPU, rather than the CPU running. */
+static void history_changed(DCPU_State *cpu)
+{
+	DCPU_History	*history = cpu->history;
+
+	/* Whatever was recorded after this point no longer applies. */
+	while(history->count > history->current + 1)
+	{
+		Checkpoint	*checkpoint = &history->checkpoints[--history->count];
+
+		history->bytes -= checkpoint_bytes(checkpoint);
+		free(checkpoint->memory);
+	}
+	history_checkpoint(cpu, 1);
+	schedule_events(cpu);
+}
+
+/* Brings the CPU to a cycle, by restoring the latest checkpoint before it if it's in the past,
+ * and running forward from there. Returns 0 if the history doesn't go back that far.
+*/
+static int history_seek(DCPU_State *cpu, uint64_t timer)
+{
+	DCPU_History	*history = cpu->history;
+
+	if(timer < history->checkpoints[0].registers.timer)
+		return 0;
+	if(timer < cpu->timer)
+		history_restore(cpu, history_find(history, timer));
+	cpu->replaying = 1;
+	while(cpu->timer < timer)
+		step_cycle(cpu);
+	cpu->replaying = 0;
+
+	return 1;
+}
+
+/** \brief Starts recording the execution history of an instance, to be able to step backwards.
+ *
+ * Checkpoints of the state are taken as the CPU runs, holding just the pages of memory written
+ * since the previous one. Stepping back restores the latest checkpoint before the target, and
+ * runs forward from it, so its cost is bounded by the distance between checkpoints. These start
+ * out 4096 cycles apart. When the checkpoints outgrow \p max_bytes, every other one is dropped
+ * and the distance doubles, up to about a million cycles, after which the oldest checkpoints
+ * are dropped instead.
+ *
+ * Changes the host makes to the instance, for instance with DCPU_Load(), are recorded too, and
+ * replayed when running forward again after stepping back. The history takes over the tracking
+ * of written pages, so an instance with a history can't be used as the base of a fuzzer.
+ *
+ * \param max_bytes The limit on the memory used by checkpoints. The oldest checkpoint is
+ *        always kept, and is a copy of all of memory, so this must be at least 132 KiB.
+ *        With less room than that, every new checkpoint would replace the oldest, and the
+ *        history would reach back no further than the latest one.
+ *
+ * \return The new history, or \c NULL on failure, including if \p max_bytes is too small.
+*/
+DCPU_History * DCPU_HistoryCreate(DCPU_State *cpu, size_t max_bytes)
+{
+	DCPU_History	*history;
+
+	if(max_bytes < HISTORY_MIN_BYTES || (history = calloc(1, sizeof *history)) == NULL)
+		return NULL;
+	history->cpu = cpu;
+	history->max_bytes = max_bytes;
+	history->interval = HISTORY_INTERVAL;
+	cpu->history = history;
+	if(!history_checkpoint(cpu, 1))
+	{
+		DCPU_HistoryDestroy(history);
+		return NULL;
+	}
+	schedule_events(cpu);
+
+	return history;
+}
+
+/** \brief Detaches a history from its instance, and destroys it. */
+void DCPU_HistoryDestroy(DCPU_History *history)
+{
+	size_t	i;
+
+	if(history == NULL)
+		return;
+	if(history->cpu->history == history)
+	{
+		history->cpu->history = NULL;
+		schedule_events(history->cpu);
+	}
+	for(i = 0; i < history->count; i++)
+		free(history->checkpoints[i].memory);
+	free(history->checkpoints);
+	free(history);
+}
+
+/** \brief Steps back a number of clock cycles.
+ *
+ * This might leave the processor "mid-instruction".
+ *
+ * \return The number of cycles stepped back, which is 0 if there is no history, or if it
+ *         doesn't reach back that far, in which case the CPU is left as it was.
+*/
+size_t DCPU_StepBackCycles(DCPU_State *cpu, size_t num_cycles)
+{
+	if(cpu->history == NULL || num_cycles > cpu->timer || !history_seek(cpu, cpu->timer - num_cycles))
+		return 0;
+	metrics_publish(cpu);
+
+	return num_cycles;
+}
+
+/** \brief Steps back to the start of the previous instruction.
+ *
+ * If the CPU is in the middle of an instruction, this steps back to the start of that one.
+ *
+ * \return The number of cycles stepped back, which is 0 if there is no history, or if it
+ *         doesn't reach back that far, in which case the CPU is left as it was.
+*/
+size_t DCPU_StepBackInstruction(DCPU_State *cpu)
+{
+	DCPU_History	*history = cpu->history;
+	const uint64_t	now = cpu->timer;
+	uint64_t	end = now, found = UINT64_MAX;
+	size_t		index;
+
+	if(history == NULL || now == 0 || now - 1 < history->checkpoints[0].registers.timer)
+		return 0;
+	/* Replay from one checkpoint after another, until an instruction boundary turns up. */
+	for(index = history_find(history, now - 1);; index = history_find(history, end - 1))
+	{
+		history_restore(cpu, index);
+		cpu->replaying = 1;
+		for(;;)
+		{
+			if(cpu->inst == 0 && cpu->skip == 0)
+				found = cpu->timer;
+			if(cpu->timer + 1 >= end)
+				break;
+			step_cycle(cpu);
+		}
+		cpu->replaying = 0;
+		end = history->checkpoints[index].registers.timer;
+		if(found != UINT64_MAX || index == 0 || end == 0)
+			break;
+	}
+	if(found == UINT64_MAX)
+	{
+		history_seek(cpu, now);
+		return 0;
+	}
+	history_seek(cpu, found);
+	metrics_publish(cpu);
+
+	return now - found;
+}
+
+/** \brief Steps back to just after the latest write to a word of memory.
+ *
+ * This finds the latest cycle, before the current one, in which the CPU wrote to
+ * the given address, even if it wrote the value that was already there, and leaves
+ * the CPU just after that cycle. Checkpoints between which the address' page wasn't
+ * written are skipped without replaying them.
+ *
+ * \return The number of cycles stepped back, which is 0 if there is no history, or if
+ *         no write was found in it, in which case the CPU is left as it was.
+*/
+size_t DCPU_StepBackToWrite(DCPU_State *cpu, uint16_t address)
+{
+	DCPU_History	*history = cpu->history;
+	const uint64_t	now = cpu->timer;
+	const size_t	page = address / PAGE_SIZE;
+	uint64_t	end = now - 1, found = 0;
+	uint32_t	written;
+	size_t		index, last, i;
+
+	if(history == NULL || now == 0 || now - 1 < history->checkpoints[0].registers.timer)
+		return 0;
+	written = cpu->dirty[page / 32];
+	last = history->current;
+	cpu->watch = address;
+	for(index = history_find(history, end);; index = history_find(history, end - 1))
+	{
+		for(i = index + 1; i <= last; i++)
+			written |= history->checkpoints[i].pages[page / 32];
+		if(written & (1u << (page % 32)))
+		{
+			history_restore(cpu, index);
+			cpu->watch_hit = 0;
+			cpu->replaying = 1;
+			while(cpu->timer < end)
+				step_cycle(cpu);
+			cpu->replaying = 0;
+			if((found = cpu->watch_hit) != 0)
+				break;
+		}
+		written = 0;
+		last = index;
+		end = history->checkpoints[index].registers.timer;
+		if(index == 0 || end == 0)
+			break;
+	}
+	cpu->watch = MEM_SIZE;
+	if(found == 0)
+	{
+		history_seek(cpu, now);
+		return 0;
+	}
+	history_seek(cpu, found);
+	metrics_publish(cpu);
+
+	return now - found;
+}
+
 /* -------------------------------------------------------------------------- */
 
 #if defined CADE_STANDALONE
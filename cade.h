@@ -17,8 +17,13 @@
 #define	CADE_H
 
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
+#if defined __cplusplus
+extern "C" {
+#endif
+
 /* -------------------------------------------------------------------------- */
 
 /** \file cade.h
@@ -44,6 +49,135 @@ typedef enum {
 /** \brief Pre-declaration of the DCPU_State structure, an opaque representation of the CPU's state. */
 typedef struct DCPU_State	DCPU_State;
 
+/** \brief Reasons for DCPU_Run() to return. */
+typedef enum {
+	DCPU_RUN_BUDGET = 1,				/**< The cycle budget ran out. */
+	DCPU_RUN_WAIT_IO,				/**< The guest is waiting for the host to complete an I/O request. */
+	DCPU_RUN_BREAKPOINT,				/**< The next instruction is at a breakpoint. */
+	DCPU_RUN_STUCK,					/**< An instruction jumped to itself. */
+	DCPU_RUN_HALTED,				/**< The DCPU_STOP instruction was executed. */
+	DCPU_RUN_STOPPED				/**< DCPU_RequestStop() was called. */
+} DCPU_RunStatus;
+
+/** \brief Layouts of binary image files, for DCPU_LoadFile() and DCPU_ImageOpen().
+ *
+ * Raw images are just the words, in either byte order. Images may also start with an
+ * 8-byte header: the characters \c DC16, the load address as a big-endian word, and a
+ * big-endian word of flags, where bit 0 is set if the words that follow are little-endian.
+*/
+typedef enum {
+	DCPU_IMAGE_AUTO = 0,				/**< Use the header if there is one, otherwise big-endian raw words. */
+	DCPU_IMAGE_BIG_ENDIAN,				/**< Big-endian raw words, with no header. */
+	DCPU_IMAGE_LITTLE_ENDIAN			/**< Little-endian raw words, with no header. */
+} DCPU_ImageFormat;
+
+/** \brief Pre-declaration of the DCPU_Image structure, an opened binary image file. */
+typedef struct DCPU_Image	DCPU_Image;
+
+/** \brief Pre-declaration of the DCPU_Device structure, an opaque device attached to an instance. */
+typedef struct DCPU_Device	DCPU_Device;
+
+/** \brief The callbacks that implement a kind of device, see DCPU_DeviceCreate().
+ *
+ * All callbacks are optional, except \c event for devices that schedule events.
+*/
+typedef struct {
+	const char	*name;				/**< The name of the kind of device. */
+	/** \brief Brings the device up to date, from the cycle \p from to the cycle \p to. */
+	void		(*sync)(DCPU_Device *device, uint64_t from, uint64_t to);
+	/** \brief Called after the CPU has written \p value at \p offset into the device's memory. */
+	void		(*write)(DCPU_Device *device, uint16_t offset, uint16_t value);
+	/** \brief Called when the event scheduled with DCPU_DeviceSchedule() comes due. */
+	void		(*event)(DCPU_Device *device);
+	/** \brief Called when the device is destroyed, to free its own state. */
+	void		(*destroy)(DCPU_Device *device);
+} DCPU_DeviceClass;
+
+/** \brief Pre-declaration of the DCPU_StateFile structure, an opened save-state file. */
+typedef struct DCPU_StateFile	DCPU_StateFile;
+
+/** \brief Flag for DCPU_SaveState(), to compress memory. */
+#define	DCPU_SAVE_COMPRESS	(1 << 0)
+
+/** \brief Operational counters of an instance, as returned by DCPU_GetMetrics().
+ *
+ * All counters start at zero when the instance is initialized, and count up from there.
+*/
+typedef struct {
+	uint64_t	cycles;				/**< Clock cycles executed. */
+	uint64_t	instructions;			/**< Instructions fetched, not counting skipped ones. */
+	uint64_t	skipped;			/**< Instructions skipped because an \c IFx condition failed. */
+	uint64_t	ifs_taken;			/**< \c IFx instructions whose condition held. */
+	uint64_t	ifs_not_taken;			/**< \c IFx instructions whose condition failed. */
+	uint64_t	divmods;			/**< \c DIV and \c MOD instructions executed. */
+	uint64_t	memory_reads;			/**< Words read from memory, including instruction words. */
+	uint64_t	memory_writes;			/**< Words written to memory by the CPU. */
+	uint64_t	stuck;				/**< Times DCPU_StepUntilStuck(), DCPU_StepUntilRepeat() or DCPU_Run() found the CPU stuck. */
+} DCPU_Metrics;
+
+/** \brief Pre-declaration of the DCPU_Fuzzer structure, an opaque coverage-guided fuzzer. */
+typedef struct DCPU_Fuzzer	DCPU_Fuzzer;
+
+/** \brief Pre-declaration of the DCPU_Display structure, an opaque LEM1802-style text display. */
+typedef struct DCPU_Display	DCPU_Display;
+
+/** \brief Pre-declaration of the DCPU_History structure, an opaque execution history for stepping backwards. */
+typedef struct DCPU_History	DCPU_History;
+
+/** \brief The width of a display, in cells. */
+#define	DCPU_DISPLAY_COLUMNS	32
+
+/** \brief The height of a display, in cells. */
+#define	DCPU_DISPLAY_ROWS	12
+
+/** \brief The number of cells, and words of video memory, of a display. */
+#define	DCPU_DISPLAY_CELLS	(DCPU_DISPLAY_COLUMNS * DCPU_DISPLAY_ROWS)
+
+/** \brief The width of a display, in pixels. */
+#define	DCPU_DISPLAY_WIDTH	(4 * DCPU_DISPLAY_COLUMNS)
+
+/** \brief The height of a display, in pixels. */
+#define	DCPU_DISPLAY_HEIGHT	(8 * DCPU_DISPLAY_ROWS)
+
+/** \brief A range of consecutive display cells, numbered left to right and top to bottom. */
+typedef struct {
+	uint16_t	first;				/**< The first cell in the range. */
+	uint16_t	count;				/**< The number of cells in the range. */
+} DCPU_CellRange;
+
+/** \brief The size, in bytes, of an edge coverage map. */
+#define	DCPU_COVERAGE_SIZE	8192
+
+/** \brief The state a natively compiled block runs on, see DCPU_Recompile().
+ *
+ * This is filled in from the instance by DCPU_RunNative() before it calls any blocks, and
+ * copied back when they return. Only generated code should touch it.
+*/
+typedef struct {
+	DCPU_State	*cpu;				/**< The instance being run. */
+	uint16_t	*memory;			/**< The instance's memory. */
+	uint16_t	registers[DCPU_REG_COUNT];	/**< The registers, indexed by DCPU_Register. */
+	uint16_t	sp, pc, o, dummy;		/**< The other registers, and the target of stores into literals. */
+	uint64_t	timer;				/**< Cycle counter. */
+	uint64_t	instructions;			/**< Number of instructions run. */
+	int		exit;				/**< Set by DCPU_NativeLoad() and DCPU_NativeStore(), to return to the caller. */
+	int		looped;				/**< Set when an instruction has jumped to itself. */
+	uint32_t	written[8];			/**< Bitmap of pages written without DCPU_NativeStore(). */
+	uint8_t		read_hooks[256];		/**< Pages whose reads go through DCPU_NativeLoad(). */
+	uint8_t		write_hooks[256];		/**< Pages whose writes go through DCPU_NativeStore(). */
+} DCPU_NativeFrame;
+
+/** \brief A natively compiled basic block, which runs from the frame's \c pc and leaves the next one there. */
+typedef void (*DCPU_NativeBlock)(DCPU_NativeFrame *frame);
+
+/** \brief A module of natively compiled code, as generated by DCPU_Recompile(). */
+typedef struct {
+	const DCPU_NativeBlock	*blocks;		/**< The block starting at each address, or \c NULL. */
+	const uint16_t		*cycles;		/**< The most cycles each block can take. */
+	const uint64_t		*page_hashes;		/**< The digests of the compiled pages, which must match for blocks in them to run. */
+	const uint32_t		*code_pages;		/**< Bitmap of the pages that blocks were compiled from. */
+} DCPU_NativeModule;
+
 /** This is <tt>SUB PC, 1</tt>, which is a 1-instruction infinite loop
  * that doesn't depend on the address it's assembled at.
 */
@@ -58,6 +192,12 @@ void		DCPU_Destroy(DCPU_State *cpu);
 
 void		DCPU_Init(DCPU_State *cpu);
 void		DCPU_Load(DCPU_State *cpu, uint16_t address, const uint16_t *data, size_t length);
+size_t		DCPU_LoadFile(DCPU_State *cpu, uint16_t address, const char *filename, DCPU_ImageFormat format);
+DCPU_Image *	DCPU_ImageOpen(const char *filename, DCPU_ImageFormat format);
+void		DCPU_ImageClose(DCPU_Image *image);
+size_t		DCPU_ImageGetLength(const DCPU_Image *image);
+void		DCPU_ImageLoad(const DCPU_Image *image, DCPU_State *cpu, uint16_t address);
+void		DCPU_SetCoverageMap(DCPU_State *cpu, uint8_t *map);
 
 uint16_t	DCPU_GetRegister(const DCPU_State *cpu, DCPU_Register reg);
 uint16_t	DCPU_GetPC(const DCPU_State *cpu);
@@ -71,5 +211,64 @@ void		DCPU_Dump(const DCPU_State *cpu, uint16_t start, size_t length);
 void		DCPU_StepCycles(DCPU_State *cpu, size_t num_cycles);
 size_t		DCPU_StepInstruction(DCPU_State *cpu);
 size_t		DCPU_StepUntilStuck(DCPU_State *cpu);
+DCPU_RunStatus	DCPU_Run(DCPU_State *cpu, size_t budget, size_t *num_cycles);
+void		DCPU_SetBreakpoint(DCPU_State *cpu, uint16_t address, int enabled);
+void		DCPU_SetIOPort(DCPU_State *cpu, uint16_t address);
+uint16_t	DCPU_GetIORequest(const DCPU_State *cpu);
+void		DCPU_CompleteIO(DCPU_State *cpu, uint16_t result);
+size_t		DCPU_StepUntilRepeat(DCPU_State *cpu, size_t max_cycles, size_t *period);
+void		DCPU_RequestStop(DCPU_State *cpu);
+int		DCPU_WasStopped(const DCPU_State *cpu);
+
+DCPU_RunStatus	DCPU_RunNative(DCPU_State *cpu, const DCPU_NativeModule *module, size_t budget, size_t *num_cycles);
+uint16_t	DCPU_NativeLoad(DCPU_NativeFrame *frame, uint16_t address, uint64_t timer);
+void		DCPU_NativeStore(DCPU_NativeFrame *frame, uint16_t address, uint16_t value, uint64_t timer);
+size_t		DCPU_Recompile(FILE *out, const DCPU_State *cpu, const uint16_t *entries, size_t count, const char *name);
+
+uint64_t	DCPU_GetStateHash(DCPU_State *cpu);
+
+DCPU_History *	DCPU_HistoryCreate(DCPU_State *cpu, size_t max_bytes);
+void		DCPU_HistoryDestroy(DCPU_History *history);
+size_t		DCPU_StepBackCycles(DCPU_State *cpu, size_t num_cycles);
+size_t		DCPU_StepBackInstruction(DCPU_State *cpu);
+size_t		DCPU_StepBackToWrite(DCPU_State *cpu, uint16_t address);
+
+DCPU_Device *	DCPU_DeviceCreate(DCPU_State *cpu, const DCPU_DeviceClass *type, uint16_t address, uint16_t length, void *data);
+void		DCPU_DeviceDestroy(DCPU_Device *device);
+void *		DCPU_DeviceGetData(const DCPU_Device *device);
+uint64_t	DCPU_DeviceGetTime(const DCPU_Device *device);
+void		DCPU_DeviceSchedule(DCPU_Device *device, uint64_t timer);
+void		DCPU_DeviceCancel(DCPU_Device *device);
+uint16_t	DCPU_DeviceLoad(const DCPU_Device *device, uint16_t offset);
+void		DCPU_DeviceStore(DCPU_Device *device, uint16_t offset, uint16_t value);
+DCPU_Device *	DCPU_ClockCreate(DCPU_State *cpu, uint16_t address);
+DCPU_Device *	DCPU_DiskCreate(DCPU_State *cpu, uint16_t address, const char *filename, DCPU_ImageFormat format, int read_only);
+
+int		DCPU_SaveState(const DCPU_State *cpu, const char *filename, unsigned int flags);
+int		DCPU_LoadState(DCPU_State *cpu, const char *filename);
+DCPU_StateFile *	DCPU_StateFileOpen(const char *filename);
+int		DCPU_StateFileRestore(const DCPU_StateFile *file, DCPU_State *cpu);
+void		DCPU_StateFileClose(DCPU_StateFile *file);
+
+void		DCPU_GetMetrics(const DCPU_State *cpu, DCPU_Metrics *metrics);
+int		DCPU_WriteMetrics(FILE *out, const DCPU_State * const *cpus, size_t count);
+
+DCPU_Fuzzer *	DCPU_FuzzerCreate(const DCPU_State *cpu, uint16_t input_address, size_t input_length, size_t max_cycles);
+void		DCPU_FuzzerDestroy(DCPU_Fuzzer *fuzzer);
+size_t		DCPU_FuzzerAddSeed(DCPU_Fuzzer *fuzzer, const uint16_t *input, size_t length);
+size_t		DCPU_FuzzerRun(DCPU_Fuzzer *fuzzer, size_t iterations);
+size_t		DCPU_FuzzerGetCorpusSize(const DCPU_Fuzzer *fuzzer);
+const uint16_t *	DCPU_FuzzerGetInput(const DCPU_Fuzzer *fuzzer, size_t index);
+size_t		DCPU_FuzzerGetEdgeCount(const DCPU_Fuzzer *fuzzer);
+const uint8_t *	DCPU_FuzzerGetCoverage(const DCPU_Fuzzer *fuzzer);
+
+DCPU_Display *	DCPU_DisplayCreate(DCPU_State *cpu);
+void		DCPU_DisplayDestroy(DCPU_Display *display);
+void		DCPU_DisplayMap(DCPU_Display *display, uint16_t video, uint16_t font, uint16_t palette);
+size_t		DCPU_DisplayRender(DCPU_Display *display, uint8_t *rgba, size_t stride, int blink, DCPU_CellRange *ranges, size_t max_ranges);
+
+#if defined __cplusplus
+}
+#endif
 
 #endif	/* CADE_H */
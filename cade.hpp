@@ -0,0 +1,169 @@
+/*
+ * C++20 coroutine adapter for the "CADE" DCPU-16 emulator.
+ *
+ * Licensed under the GNU Lesser General Public License, v3.
+*/
+
+#if !defined CADE_HPP
+#define	CADE_HPP
+
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <utility>
+
+#include "cade.h"
+
+/** \file cade.hpp
+ *
+ * A thin layer over DCPU_Run(), for hosts that run many guests from one event loop thread.
+ *
+ * Each guest is driven by a coroutine, which awaits Loop::execute() to run the guest until
+ * it needs attention. While it runs, it takes turns with all other guests on the loop, a
+ * slice of cycles at a time. When the guest makes an I/O request, the coroutine can await
+ * whatever the host uses for asynchronous I/O, without blocking the thread:
+ *
+ * \code
+ * cade::Task drive(cade::Loop &loop, DCPU_State *cpu)
+ * {
+ * 	for(;;)
+ * 	{
+ * 		const DCPU_RunStatus status = co_await loop.execute(cpu);
+ *
+ * 		if(status != DCPU_RUN_WAIT_IO)
+ * 			break;
+ * 		DCPU_CompleteIO(cpu, co_await host_read(DCPU_GetIORequest(cpu)));
+ * 	}
+ * }
+ * \endcode
+*/
+
+namespace cade {
+
+class Loop;
+
+/** \brief A coroutine driving a guest, which is started by Loop::spawn(). */
+class Task {
+public:
+	/** \brief The promise type, as required by the language. */
+	struct promise_type {
+		Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::terminate(); }
+	};
+
+	Task(Task &&other) noexcept : handle(std::exchange(other.handle, {})) {}
+	Task & operator=(Task &&other) = delete;
+
+	/** \brief Destroys the coroutine, unless it was handed to a loop. */
+	~Task()
+	{
+		if(handle)
+			handle.destroy();
+	}
+
+private:
+	friend class Loop;
+
+	explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+	std::coroutine_handle<promise_type>	handle;
+};
+
+/** \brief Runs any number of guests on one thread, in turn, a slice of cycles at a time. */
+class Loop {
+	/** \brief A coroutine waiting for its turn, and the guest to run for it if any. */
+	struct Job {
+		DCPU_State		*cpu;
+		std::coroutine_handle<>	handle;
+		DCPU_RunStatus		*status;
+	};
+
+public:
+	/** \brief Awaitable that gives a coroutine its turn, see execute() and yield(). */
+	class Turn {
+	public:
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> handle) { loop.ready.push_back({ cpu, handle, &status }); }
+		DCPU_RunStatus await_resume() const noexcept { return status; }
+
+	private:
+		friend class Loop;
+
+		Turn(Loop &loop, DCPU_State *cpu) : loop(loop), cpu(cpu) {}
+
+		Loop		&loop;
+		DCPU_State	*cpu;
+		DCPU_RunStatus	status = DCPU_RUN_BUDGET;
+	};
+
+	/** \brief Creates a loop that runs guests \p slice cycles per turn. */
+	explicit Loop(std::size_t slice = 10000) : slice(slice) {}
+
+	Loop(const Loop &) = delete;
+	Loop & operator=(const Loop &) = delete;
+
+	/** \brief Destroys any coroutines that are still waiting for their turn. */
+	~Loop()
+	{
+		for(const Job &job : ready)
+			job.handle.destroy();
+	}
+
+	/** \brief Hands a task to the loop, to start on its next turn. */
+	void spawn(Task task)
+	{
+		ready.push_back({ nullptr, std::exchange(task.handle, {}), nullptr });
+	}
+
+	/** \brief Resumes a coroutine on its next turn, for instance when its host I/O has completed. */
+	void post(std::coroutine_handle<> handle)
+	{
+		ready.push_back({ nullptr, handle, nullptr });
+	}
+
+	/** \brief Runs a guest with DCPU_Run() until it needs attention.
+	 *
+	 * The result of awaiting this is the guest's status, which is never \c DCPU_RUN_BUDGET.
+	*/
+	Turn execute(DCPU_State *cpu)
+	{
+		return Turn(*this, cpu);
+	}
+
+	/** \brief Lets all other coroutines that are ready have a turn first. */
+	Turn yield()
+	{
+		return Turn(*this, nullptr);
+	}
+
+	/** \brief Runs turns until no coroutine is ready, because they're all done or waiting for I/O.
+	 *
+	 * Guests that run out of their slice go to the back of the line, so they all get the
+	 * same share of the thread.
+	*/
+	void run()
+	{
+		while(!ready.empty())
+		{
+			const Job	job = ready.front();
+
+			ready.pop_front();
+			if(job.cpu != nullptr && (*job.status = DCPU_Run(job.cpu, slice, nullptr)) == DCPU_RUN_BUDGET)
+				ready.push_back(job);
+			else
+				job.handle.resume();
+		}
+	}
+
+private:
+	std::size_t		slice;
+	std::deque<Job>		ready;
+};
+
+}
+
+#endif	/* CADE_HPP */
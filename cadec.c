@@ -0,0 +1,49 @@
+/*
+ * Ahead-of-time compiler from DCPU-16 images to C, for the "CADE" DCPU-16 emulator.
+ *
+ * Usage: cadec NAME IMAGE ENTRY...
+ *
+ * Loads the image at address 0, compiles the code reachable from the entry points with
+ * DCPU_Recompile(), and writes the C source of a module called NAME to stdout. Compile
+ * and link that with cade.c, and run it with DCPU_RunNative().
+ *
+ * Licensed under the GNU Lesser General Public License, v3.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cade.h"
+
+int main(int argc, char *argv[])
+{
+	DCPU_State	*cpu;
+	uint16_t	*entries;
+	size_t		count;
+	int		i;
+
+	if(argc < 4)
+	{
+		fprintf(stderr, "Usage: %s NAME IMAGE ENTRY...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	if((cpu = DCPU_Create()) == NULL || (entries = malloc((argc - 3) * sizeof *entries)) == NULL)
+		return EXIT_FAILURE;
+	if(DCPU_LoadFile(cpu, 0, argv[2], DCPU_IMAGE_AUTO) == 0)
+	{
+		fprintf(stderr, "%s: couldn't load %s\n", argv[0], argv[2]);
+		return EXIT_FAILURE;
+	}
+	for(i = 3; i < argc; i++)
+		entries[i - 3] = strtoul(argv[i], NULL, 0);
+	count = DCPU_Recompile(stdout, cpu, entries, argc - 3, argv[1]);
+	free(entries);
+	DCPU_Destroy(cpu);
+	if(count == 0)
+	{
+		fprintf(stderr, "%s: no code found in %s\n", argv[0], argv[2]);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
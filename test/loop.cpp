@@ -0,0 +1,92 @@
+/*
+ * Tests for the C++20 coroutine adapter of the "CADE" DCPU-16 emulator.
+ *
+ * Licensed under the GNU Lesser General Public License, v3.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "cade.hpp"
+
+/* An I/O request the host hasn't answered yet, and the coroutine waiting for it. */
+struct Pending {
+	std::coroutine_handle<>	handle;
+	uint16_t		request;
+	uint16_t		*result;
+};
+
+static std::vector<Pending>	pending;
+
+/* Stands in for the host's asynchronous I/O, which answers each request with twice its value. */
+struct HostRead {
+	uint16_t	request, result = 0;
+
+	bool await_ready() const noexcept { return false; }
+	void await_suspend(std::coroutine_handle<> handle) { pending.push_back({ handle, request, &result }); }
+	uint16_t await_resume() const noexcept { return result; }
+};
+
+/* Drives a guest until it stops for anything but I/O, as in the example in cade.hpp. */
+static cade::Task drive(cade::Loop &loop, DCPU_State *cpu, DCPU_RunStatus *last)
+{
+	for(;;)
+	{
+		*last = co_await loop.execute(cpu);
+		if(*last != DCPU_RUN_WAIT_IO)
+			break;
+		DCPU_CompleteIO(cpu, co_await HostRead{ DCPU_GetIORequest(cpu) });
+	}
+}
+
+static int test_round_trip(void)
+{
+	/* Set A to 16 and 17, make an I/O request of it at 0x3000, then load the result into B and halt. */
+	const uint16_t	code[][6] = { { 0xc001, 0x01e1, 0x3000, 0x7811, 0x3000, DCPU_STOP },
+				      { 0xc401, 0x01e1, 0x3000, 0x7811, 0x3000, DCPU_STOP } };
+	DCPU_State	*cpus[2] = { DCPU_Create(), DCPU_Create() };
+	DCPU_RunStatus	last[2] = { DCPU_RUN_BUDGET, DCPU_RUN_BUDGET };
+	int		result = 1;
+
+	std::printf("%-30s: ", "Loop I/O round trip");
+	if(cpus[0] == nullptr || cpus[1] == nullptr)
+		result = 0;
+	else
+	{
+		/* A slice of one cycle has the guests take turns in the middle of their instructions. */
+		cade::Loop	loop(1);
+
+		for(int i = 0; i < 2; i++)
+		{
+			DCPU_Load(cpus[i], 0x0000, code[i], sizeof code[i] / sizeof *code[i]);
+			DCPU_SetIOPort(cpus[i], 0x3000);
+			loop.spawn(drive(loop, cpus[i], &last[i]));
+		}
+		loop.run();
+		/* Both guests are waiting for the host now, which answers them in the opposite order. */
+		result &= pending.size() == 2 && pending[0].request == 16 && pending[1].request == 17;
+		while(!pending.empty())
+		{
+			const Pending	io = pending.back();
+
+			pending.pop_back();
+			*io.result = 2 * io.request;
+			loop.post(io.handle);
+		}
+		loop.run();
+	}
+	for(int i = 0; i < 2; i++)
+	{
+		result &= cpus[i] != nullptr && last[i] == DCPU_RUN_HALTED && DCPU_GetRegister(cpus[i], DCPU_REG_B) == 32 + 2 * i;
+		DCPU_Destroy(cpus[i]);
+	}
+	std::printf("%s\n", result ? "PASS" : "FAIL");
+
+	return result;
+}
+
+int main(void)
+{
+	return test_round_trip() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,272 @@
+/*
+ * Natively compiled DCPU-16 code, generated by DCPU_Recompile(). Do not edit.
+*/
+
+#include "cade.h"
+
+#define	READ(address, cycle)	(f->read_hooks[(address) >> 8] ? DCPU_NativeLoad(f, (address), (cycle)) : m[(address)])
+#define	WRITE(address, value, cycle)	do { if(f->write_hooks[(address) >> 8]) DCPU_NativeStore(f, (address), (value), (cycle)); else { m[(address)] = (value); f->written[(address) >> 13] |= 1u << ((address) >> 8 & 31); } } while(0)
+
+static void block_0000(DCPU_NativeFrame *f)
+{
+	uint16_t *const m = f->memory;
+	uint16_t ra = f->registers[0];
+	uint16_t rb = f->registers[1];
+	uint16_t ri = f->registers[6];
+	uint16_t sp = f->sp;
+	uint16_t pc;
+	uint64_t t = f->timer;
+	unsigned int n = 0;
+
+	{
+		/* 0x0000: 0x8061 */
+		t += 1;
+		n++;
+		const uint16_t vb = 0x0000;
+		ri = vb;
+	}
+	{
+		/* 0x0001: 0x8001 */
+		t += 1;
+		n++;
+		const uint16_t vb = 0x0000;
+		ra = vb;
+	}
+	{
+		/* 0x0002: 0x1811 */
+		t += 1;
+		n++;
+		const uint16_t vb = ri;
+		rb = vb;
+	}
+	{
+		/* 0x0003: 0xb010 */
+		t += 2;
+		n++;
+		--sp;
+		WRITE(sp, 0x0004, t - 1);
+		pc = 0x000c;
+		goto out;
+	}
+out:
+	f->registers[0] = ra;
+	f->registers[1] = rb;
+	f->registers[6] = ri;
+	f->sp = sp;
+	f->pc = pc;
+	f->timer = t;
+	f->instructions += n;
+}
+
+static void block_0002(DCPU_NativeFrame *f)
+{
+	uint16_t *const m = f->memory;
+	uint16_t rb = f->registers[1];
+	uint16_t ri = f->registers[6];
+	uint16_t sp = f->sp;
+	uint16_t pc;
+	uint64_t t = f->timer;
+	unsigned int n = 0;
+
+	{
+		/* 0x0002: 0x1811 */
+		t += 1;
+		n++;
+		const uint16_t vb = ri;
+		rb = vb;
+	}
+	{
+		/* 0x0003: 0xb010 */
+		t += 2;
+		n++;
+		--sp;
+		WRITE(sp, 0x0004, t - 1);
+		pc = 0x000c;
+		goto out;
+	}
+out:
+	f->registers[1] = rb;
+	f->registers[6] = ri;
+	f->sp = sp;
+	f->pc = pc;
+	f->timer = t;
+	f->instructions += n;
+}
+
+static void block_0004(DCPU_NativeFrame *f)
+{
+	uint16_t *const m = f->memory;
+	uint16_t ra = f->registers[0];
+	uint16_t rb = f->registers[1];
+	uint16_t ri = f->registers[6];
+	uint16_t o = f->o;
+	uint16_t pc;
+	uint64_t t = f->timer;
+	unsigned int n = 0;
+
+	{
+		/* 0x0004: 0x0402 */
+		t += 2;
+		n++;
+		const uint16_t va = ra;
+		const uint16_t vb = rb;
+		const uint32_t w = va + vb;
+		ra = w & 0xffff;
+		o = w > 0xffff;
+	}
+	{
+		/* 0x0005: 0x0161 0x1000 */
+		const uint16_t xa = 0x1000 + ri;
+		t += 2;
+		n++;
+		const uint16_t vb = ra;
+		WRITE(xa, vb, t - 1);
+	}
+	if(f->exit)
+	{
+		pc = 0x0007;
+		goto out;
+	}
+	{
+		/* 0x0007: 0x8462 */
+		t += 2;
+		n++;
+		const uint16_t va = ri;
+		const uint16_t vb = 0x0001;
+		const uint32_t w = va + vb;
+		ri = w & 0xffff;
+		o = w > 0xffff;
+	}
+	{
+		/* 0x0008: 0x7c6d 0x0100 */
+		t += 3;
+		n++;
+		const uint16_t va = ri;
+		const uint16_t vb = 0x0100;
+		if(va != vb)
+		{
+			/* 0x000a: 0x89c1 */
+			t += 1;
+			n++;
+			const uint16_t vb = 0x0002;
+			pc = vb;
+			if(pc == 0x000a)
+				f->looped = 1;
+			goto out;
+		}
+		else
+			t += 2;
+	}
+	{
+		/* 0x000b: 0x85c3 */
+		t += 2;
+		n++;
+		const uint16_t va = 0x000c;
+		const uint16_t vb = 0x0001;
+		const uint32_t w = (uint32_t) va - vb;
+		pc = w & 0xffff;
+		if(pc == 0x000b)
+			f->looped = 1;
+		o = w > 0xffff ? 0xffff : 0;
+		goto out;
+	}
+out:
+	f->registers[0] = ra;
+	f->registers[1] = rb;
+	f->registers[6] = ri;
+	f->o = o;
+	f->pc = pc;
+	f->timer = t;
+	f->instructions += n;
+}
+
+static void block_000b(DCPU_NativeFrame *f)
+{
+	uint16_t o = f->o;
+	uint16_t pc;
+	uint64_t t = f->timer;
+	unsigned int n = 0;
+
+	{
+		/* 0x000b: 0x85c3 */
+		t += 2;
+		n++;
+		const uint16_t va = 0x000c;
+		const uint16_t vb = 0x0001;
+		const uint32_t w = (uint32_t) va - vb;
+		pc = w & 0xffff;
+		if(pc == 0x000b)
+			f->looped = 1;
+		o = w > 0xffff ? 0xffff : 0;
+		goto out;
+	}
+out:
+	f->o = o;
+	f->pc = pc;
+	f->timer = t;
+	f->instructions += n;
+}
+
+static void block_000c(DCPU_NativeFrame *f)
+{
+	uint16_t *const m = f->memory;
+	uint16_t rb = f->registers[1];
+	uint16_t sp = f->sp;
+	uint16_t o = f->o;
+	uint16_t pc;
+	uint64_t t = f->timer;
+	unsigned int n = 0;
+
+	{
+		/* 0x000c: 0x0414 */
+		t += 2;
+		n++;
+		const uint16_t va = rb;
+		const uint16_t vb = rb;
+		const uint32_t w = (uint32_t) va * vb;
+		rb = w & 0xffff;
+		o = w >> 16;
+	}
+	{
+		/* 0x000d: 0x61c1 */
+		const uint16_t xb = sp++;
+		t += 1;
+		n++;
+		const uint16_t vb = READ(xb, t - 1);
+		pc = vb;
+		if(pc == 0x000d)
+			f->looped = 1;
+		goto out;
+	}
+out:
+	f->registers[1] = rb;
+	f->sp = sp;
+	f->o = o;
+	f->pc = pc;
+	f->timer = t;
+	f->instructions += n;
+}
+
+static const DCPU_NativeBlock blocks[0x10000] = {
+	[0x0000] = block_0000,
+	[0x0002] = block_0002,
+	[0x0004] = block_0004,
+	[0x000b] = block_000b,
+	[0x000c] = block_000c,
+};
+
+static const uint16_t cycles[0x10000] = {
+	[0x0000] = 5,
+	[0x0002] = 3,
+	[0x0004] = 14,
+	[0x000b] = 2,
+	[0x000c] = 3,
+};
+
+static const uint64_t page_hashes[256] = {
+	[0x00] = 0x2103b497df4d9079ull,
+};
+
+static const uint32_t code_pages[8] = { 0x00000001, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000 };
+
+const DCPU_NativeModule native = { blocks, cycles, page_hashes, code_pages };
@@ -4,9 +4,12 @@
  * Written by Emil Brink <emil@obsession.se>, April 2012.
 */
 
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "cade.h"
 
@@ -30,9 +33,13 @@ static void test_begin(DCPU_State *cpu, const uint16_t *code, size_t words, cons
 	old_stdout = stdout;
 	stdout = fopen("dump.txt", "w+");
 
+	/* Tests that need to run the code in some other way pass no words. */
 	DCPU_Init(cpu);
-	DCPU_Load(cpu, 0x0000, code, words);
-	DCPU_StepUntilStuck(cpu);
+	if(words > 0)
+	{
+		DCPU_Load(cpu, 0x0000, code, words);
+		DCPU_StepUntilStuck(cpu);
+	}
 }
 
 static int test_end(int result)
@@ -98,6 +105,597 @@ static int test_push1(DCPU_State *cpu)
 	return test_end(DCPU_GetMemory(cpu, 0xfffe) == 0xcafe && DCPU_GetMemory(cpu, 0xfffd) == 0xbabe);
 }
 
+static int test_metrics(DCPU_State *cpu)
+{
+	const uint16_t		code[] = { 0x7c01, 0x4700, 0xc411, 0x0402, 0x85c3 };
+	const DCPU_State	*fleet[] = { NULL, cpu };
+	DCPU_Metrics		metrics;
+	FILE			*out;
+	char			line[128];
+	int			result, found = 0;
+
+	test_begin(cpu, code, sizeof code / sizeof *code, "Metrics of A=0x4700 + 0x11");
+	DCPU_GetMetrics(cpu, &metrics);
+	result = metrics.cycles == 7 && metrics.instructions == 4 && metrics.memory_reads == 5 &&
+		metrics.memory_writes == 0 && metrics.stuck == 1;
+	if((out = tmpfile()) != NULL)
+	{
+		result &= DCPU_WriteMetrics(out, fleet, sizeof fleet / sizeof *fleet);
+		rewind(out);
+		while(fgets(line, sizeof line, out) != NULL)
+			found |= strcmp(line, "cade_cycles_total{cpu=\"1\"} 7\n") == 0;
+		fclose(out);
+	}
+	return test_end(result && found);
+}
+
+static DCPU_Metrics	probed;
+
+/* Reads the published counters partway through a run, as another thread would. */
+static void probe_write(DCPU_Device *device, uint16_t offset, uint16_t value)
+{
+	DCPU_GetMetrics(DCPU_DeviceGetData(device), &probed);
+}
+
+static int test_metrics_running(DCPU_State *cpu)
+{
+	/* Counts A up to 0x2100, six cycles at a time, then writes to the probe. */
+	const uint16_t		code[] = { 0x8402, 0x7c0d, 0x2100, 0x81c1, 0x85e1, 0x9000, 0x85c3 };
+	const DCPU_DeviceClass	probe = { "probe", NULL, probe_write, NULL, NULL };
+	DCPU_Device		*device;
+
+	test_begin(cpu, NULL, 0, "Metrics while running");
+	if((device = DCPU_DeviceCreate(cpu, &probe, 0x9000, 1, cpu)) == NULL)
+		return test_end(0);
+	DCPU_Load(cpu, 0x0000, code, sizeof code / sizeof *code);
+	DCPU_StepCycles(cpu, 60000);
+	DCPU_DeviceDestroy(device);
+
+	return test_end(probed.cycles > 6 * 0x2100 - 0x4000 && probed.cycles <= 6 * 0x2100);
+}
+
+static int test_hash(DCPU_State *cpu)
+{
+	const uint16_t	code[] = { 0x7de1, 0x1000, 0x1234, 0x85c3 };
+	const uint16_t	other = 0x5678, same = 0x1234;
+	uint64_t	hash;
+
+	test_begin(cpu, code, sizeof code / sizeof *code, "Hash after SET [0x1000]");
+	hash = DCPU_GetStateHash(cpu);
+	DCPU_Load(cpu, 0x1000, &other, 1);
+	if(DCPU_GetStateHash(cpu) == hash)
+		return test_end(0);
+	DCPU_Load(cpu, 0x1000, &same, 1);
+
+	return test_end(DCPU_GetStateHash(cpu) == hash);
+}
+
+static int test_repeat(DCPU_State *cpu)
+{
+	/* ADD A, 1 and SET PC, 0 loop forever, but never leave PC unchanged. */
+	const uint16_t	code[] = { 0x8402, 0x81c1 };
+	size_t		period;
+
+	test_begin(cpu, code, 0, "Repeat of ADD/SET PC loop");
+	DCPU_Load(cpu, 0x0000, code, sizeof code / sizeof *code);
+	DCPU_StepUntilRepeat(cpu, 1000000, &period);
+
+	return test_end(period == 3 * 0x10000);
+}
+
+static int test_display(DCPU_State *cpu)
+{
+	/* Writes a white-on-black 'A' to the first cell of video memory at 0x8000. */
+	const uint16_t	code[] = { 0x7de1, 0x8000, 0xf041, 0x85c3 };
+	const uint16_t	b = 0xf042;
+	static uint8_t	frame[DCPU_DISPLAY_HEIGHT][DCPU_DISPLAY_WIDTH][4];
+	DCPU_CellRange	ranges[4];
+	DCPU_Display	*display;
+	int		result;
+
+	test_begin(cpu, code, 0, "Display render of 'A'");
+	if((display = DCPU_DisplayCreate(cpu)) == NULL)
+		return test_end(0);
+	DCPU_DisplayMap(display, 0x8000, 0, 0);
+	DCPU_Load(cpu, 0x0000, code, sizeof code / sizeof *code);
+	DCPU_StepUntilStuck(cpu);
+
+	/* The first frame draws everything, the next nothing, and then only what was written. */
+	result = DCPU_DisplayRender(display, &frame[0][0][0], sizeof frame[0], 0, ranges, 4) == 1 && ranges[0].first == 0 && ranges[0].count == DCPU_DISPLAY_CELLS;
+	result &= frame[1][0][0] == 0x00 && frame[2][0][0] == 0xff && frame[2][0][3] == 0xff && frame[2][3][0] == 0x00;
+	result &= DCPU_DisplayRender(display, &frame[0][0][0], sizeof frame[0], 0, ranges, 4) == 0;
+	DCPU_Load(cpu, 0x8001, &b, 1);
+	result &= DCPU_DisplayRender(display, &frame[0][0][0], sizeof frame[0], 0, ranges, 4) == 1 && ranges[0].first == 1 && ranges[0].count == 1;
+	DCPU_DisplayDestroy(display);
+
+	return test_end(result);
+}
+
+static int test_fuzz(DCPU_State *cpu)
+{
+	/* Branches on whether the input word is greater than 0x100, halting with B set to 1 or 2. */
+	const uint16_t	code[] = { 0x7801, 0x1000, 0x7c0e, 0x0100, 0x9dc1, 0x8411, 0x85c3, 0x8811, 0x85c3 };
+	DCPU_Fuzzer	*fuzzer;
+	int		result = 0;
+
+	test_begin(cpu, code, 0, "Fuzz IFG branch");
+	DCPU_Load(cpu, 0x0000, code, sizeof code / sizeof *code);
+	if((fuzzer = DCPU_FuzzerCreate(cpu, 0x1000, 1, 100)) != NULL)
+	{
+		DCPU_FuzzerRun(fuzzer, 1000);
+		result = DCPU_FuzzerGetCorpusSize(fuzzer) == 2 && DCPU_FuzzerGetEdgeCount(fuzzer) == 2 &&
+			DCPU_FuzzerGetInput(fuzzer, 0)[0] <= 0x100 && DCPU_FuzzerGetInput(fuzzer, 1)[0] > 0x100;
+		DCPU_FuzzerDestroy(fuzzer);
+	}
+	return test_end(result);
+}
+
+static int test_fuzz_edge_count(DCPU_State *cpu)
+{
+	/* Jumps back 256 times while counting A up to 0x101, which mustn't wrap the edge's count to 0. */
+	const uint16_t	code[] = { 0x8402, 0x7c0d, 0x0101, 0x81c1, 0x85c3 };
+	const uint16_t	seed = 0;
+	DCPU_Fuzzer	*fuzzer;
+	int		result = 0;
+
+	test_begin(cpu, code, 0, "Fuzz edge taken 256 times");
+	DCPU_Load(cpu, 0x0000, code, sizeof code / sizeof *code);
+	if((fuzzer = DCPU_FuzzerCreate(cpu, 0x1000, 1, 2000)) != NULL)
+	{
+		result = DCPU_FuzzerAddSeed(fuzzer, &seed, 1) == 2;
+		DCPU_FuzzerDestroy(fuzzer);
+	}
+	return test_end(result);
+}
+
+static int test_save_state(DCPU_State *cpu, unsigned int flags)
+{
+	/* Sets A to 0x1234 and stores it at 0x1000, next to some data in another chunk. */
+	const uint16_t	code[] = { 0x7c01, 0x1234, 0x01e1, 0x1000, DCPU_STOP };
+	const uint16_t	data[] = { 1, 2, 3, 3, 3, 3 };
+	DCPU_StateFile	*file;
+	DCPU_State	*copy;
+	int		result = 0;
+
+	test_begin(cpu, code, 0, "Save/restore%s", flags & DCPU_SAVE_COMPRESS ? " (compressed)" : "");
+	DCPU_Load(cpu, 0x0000, code, sizeof code / sizeof *code);
+	DCPU_Load(cpu, 0x9000, data, sizeof data / sizeof *data);
+	/* Save in the middle of the first instruction, then run both the original and the copy. */
+	DCPU_StepCycles(cpu, 1);
+	if(!DCPU_SaveState(cpu, "dump.state", flags) || (copy = DCPU_Create()) == NULL)
+		return test_end(0);
+	if((file = DCPU_StateFileOpen("dump.state")) != NULL && DCPU_StateFileRestore(file, copy))
+	{
+		result = DCPU_GetStateHash(copy) == DCPU_GetStateHash(cpu);
+		/* Finish the instruction first, so that it isn't taken for a loop. */
+		DCPU_StepCycles(cpu, 1);
+		DCPU_StepCycles(copy, 1);
+		DCPU_StepUntilStuck(cpu);
+		DCPU_StepUntilStuck(copy);
+		result &= DCPU_GetRegister(copy, DCPU_REG_A) == 0x1234 && DCPU_GetMemory(copy, 0x1000) == 0x1234;
+		result &= DCPU_GetMemory(copy, 0x9005) == 3 && DCPU_GetStateHash(copy) == DCPU_GetStateHash(cpu);
+		/* Writes to a restored instance must not reach the file. */
+		result &= DCPU_StateFileRestore(file, copy) && DCPU_GetMemory(copy, 0x1000) == 0;
+		/* Nor must saving over the file reach the restored instance. */
+		result &= DCPU_SaveState(cpu, "dump.state", flags) && DCPU_GetMemory(copy, 0x1000) == 0 && DCPU_GetMemory(copy, 0x9005) == 3;
+	}
+	DCPU_StateFileClose(file);
+	DCPU_Destroy(copy);
+	remove("dump.state");
+
+	return test_end(result);
+}
+
+/* Writes a save-state with one 4 KiB chunk moved to the end, at an offset just past a multiple of 4 KiB. */
+static int save_moved_chunk(const char *filename, const uint8_t *data, size_t size, size_t chunk, size_t past)
+{
+	uint8_t		entry[4];
+	const size_t	from = data[64 + 8 * chunk] | data[65 + 8 * chunk] << 8 | data[66 + 8 * chunk] << 16 | (size_t) data[67 + 8 * chunk] << 24;
+	const size_t	to = (size + 4095) / 4096 * 4096 + past;
+	FILE		*out;
+	size_t		i;
+	int		ok;
+
+	for(i = 0; i < sizeof entry; i++)
+		entry[i] = to >> 8 * i;
+	if(from == 0 || from + 4096 > size || (out = fopen(filename, "wb")) == NULL)
+		return 0;
+	ok = fwrite(data, 64 + 8 * chunk, 1, out) == 1 && fwrite(entry, sizeof entry, 1, out) == 1;
+	ok = ok && fwrite(data + 68 + 8 * chunk, size - 68 - 8 * chunk, 1, out) == 1;
+	for(i = size; ok && i < to; i++)
+		ok = fputc(0, out) == 0;
+	ok = ok && fwrite(data + from, 4096, 1, out) == 1;
+
+	return fclose(out) == 0 && ok;
+}
+
+static int test_save_state_layout(DCPU_State *cpu)
+{
+	const uint16_t	data[] = { 1, 2, 3 };
+	static uint8_t	saved[0x40000];
+	DCPU_StateFile	*file;
+	DCPU_State	*copy;
+	FILE		*in;
+	size_t		size = 0;
+	int		result = 0;
+
+	test_begin(cpu, NULL, 0, "Restore unaligned chunks");
+	DCPU_Load(cpu, 0x9000, data, sizeof data / sizeof *data);
+	if(!DCPU_SaveState(cpu, "dump.state", 0) || (in = fopen("dump.state", "rb")) == NULL)
+		return test_end(0);
+	size = fread(saved, 1, sizeof saved, in);
+	fclose(in);
+	if((copy = DCPU_Create()) == NULL)
+		return test_end(0);
+	/* A chunk that can't be mapped, since it's not on a page of its own, is copied instead. */
+	if(save_moved_chunk("dump.state", saved, size, 0x9000 / 2048, 2) && (file = DCPU_StateFileOpen("dump.state")) != NULL)
+	{
+		result = DCPU_StateFileRestore(file, copy) && DCPU_GetMemory(copy, 0x9002) == 3 && DCPU_GetStateHash(copy) == DCPU_GetStateHash(cpu);
+		DCPU_StateFileClose(file);
+	}
+	/* One at an odd offset can't even be read a word at a time. */
+	result &= save_moved_chunk("dump.state", saved, size, 0x9000 / 2048, 1) && DCPU_StateFileOpen("dump.state") == NULL;
+	DCPU_Destroy(copy);
+	remove("dump.state");
+
+	return test_end(result);
+}
+
+static int test_step_back(DCPU_State *cpu)
+{
+	/* Counts A up and stores it at 0x1000, and at 0x2000 too when it's 0x100. */
+	const uint16_t	code[] = { 0x8402, 0x01e1, 0x1000, 0x7c0c, 0x0100, 0x01e1, 0x2000, 0x81c1 };
+	uint64_t	hashes[16];
+	DCPU_History	*history;
+	size_t		i;
+	int		result;
+
+	test_begin(cpu, code, 0, "Step back");
+	DCPU_Load(cpu, 0x0000, code, sizeof code / sizeof *code);
+	/* Little enough room for checkpoints that they get thinned out. */
+	if((history = DCPU_HistoryCreate(cpu, 0x24000)) == NULL)
+		return test_end(0);
+	DCPU_StepCycles(cpu, 200000);
+	for(i = 0; i < 16; i++)
+	{
+		DCPU_StepInstruction(cpu);
+		hashes[i] = DCPU_GetStateHash(cpu);
+	}
+	result = 1;
+	for(i = 16; i-- > 1;)
+		result &= DCPU_StepBackInstruction(cpu) > 0 && DCPU_GetStateHash(cpu) == hashes[i - 1];
+	result &= DCPU_StepBackCycles(cpu, 100001) == 100001 && DCPU_StepBackCycles(cpu, 1000000) == 0;
+	result &= DCPU_StepBackToWrite(cpu, 0x2000) > 0 && DCPU_GetRegister(cpu, DCPU_REG_A) == 0x100 && DCPU_GetPC(cpu) == 7;
+	DCPU_HistoryDestroy(history);
+
+	/* Too little room for more than the oldest checkpoint is refused, while the least allowed still reaches back. */
+	result &= DCPU_HistoryCreate(cpu, 0x20000) == NULL;
+	if((history = DCPU_HistoryCreate(cpu, 0x21000)) == NULL)
+		return test_end(0);
+	DCPU_StepCycles(cpu, 300000);
+	result &= DCPU_StepBackCycles(cpu, 1024) == 1024;
+	DCPU_HistoryDestroy(history);
+
+	return test_end(result);
+}
+
+static int test_run(DCPU_State *cpu)
+{
+	/* Sets A to 16, makes an I/O request of it at 0x3000, then loads the result into B and halts. */
+	const uint16_t	code[] = { 0xc001, 0x01e1, 0x3000, 0x7811, 0x3000, DCPU_STOP };
+	size_t		cycles;
+	int		result;
+
+	test_begin(cpu, code, 0, "Run statuses");
+	DCPU_Load(cpu, 0x0000, code, sizeof code / sizeof *code);
+	DCPU_SetIOPort(cpu, 0x3000);
+	DCPU_SetBreakpoint(cpu, 5, 1);
+	/* The second slice ends in the middle of the request, which the third one finishes. */
+	result = DCPU_Run(cpu, 1, &cycles) == DCPU_RUN_BUDGET && DCPU_Run(cpu, 1, &cycles) == DCPU_RUN_BUDGET;
+	result &= DCPU_Run(cpu, 100, &cycles) == DCPU_RUN_WAIT_IO && cycles == 1 && DCPU_GetIORequest(cpu) == 16;
+	result &= DCPU_Run(cpu, 100, &cycles) == DCPU_RUN_WAIT_IO && cycles == 0;
+	DCPU_CompleteIO(cpu, 0x55);
+	result &= DCPU_Run(cpu, 100, &cycles) == DCPU_RUN_BREAKPOINT && DCPU_GetPC(cpu) == 5 && DCPU_GetRegister(cpu, DCPU_REG_B) == 0x55;
+	result &= DCPU_Run(cpu, 100, &cycles) == DCPU_RUN_HALTED && cycles == 2;
+
+	return test_end(result);
+}
+
+static int test_load_file(DCPU_State *cpu)
+{
+	/* A header loading four big-endian words at 0xfffe, so that they wrap around. */
+	const uint8_t	header[] = { 'D', 'C', '1', '6', 0xff, 0xfe, 0, 0, 0x12, 0x34, 0x56, 0x78, 0x9a, 0xbc, 0xde, 0xf0 };
+	uint8_t		raw[2 * 19];
+	DCPU_Image	*image;
+	FILE		*out;
+	size_t		i;
+	int		result;
+
+	test_begin(cpu, NULL, 0, "Load image files");
+	if((out = fopen("dump.bin", "wb")) == NULL || fwrite(header, sizeof header, 1, out) != 1 || fclose(out) != 0)
+		return test_end(0);
+	result = DCPU_LoadFile(cpu, 0, "dump.bin", DCPU_IMAGE_AUTO) == 4;
+	result &= DCPU_GetMemory(cpu, 0xfffe) == 0x1234 && DCPU_GetMemory(cpu, 0xffff) == 0x5678;
+	result &= DCPU_GetMemory(cpu, 0x0000) == 0x9abc && DCPU_GetMemory(cpu, 0x0001) == 0xdef0;
+
+	/* Enough little-endian words to need both vectors and single words to swap, where that's needed. */
+	for(i = 0; i < sizeof raw / 2; i++)
+	{
+		raw[2 * i] = i;
+		raw[2 * i + 1] = 0x80 + i;
+	}
+	if((out = fopen("dump.bin", "wb")) == NULL || fwrite(raw, sizeof raw, 1, out) != 1 || fclose(out) != 0)
+		return test_end(0);
+	if((image = DCPU_ImageOpen("dump.bin", DCPU_IMAGE_LITTLE_ENDIAN)) == NULL)
+		return test_end(0);
+	DCPU_ImageLoad(image, cpu, 0x100);
+	result &= DCPU_ImageGetLength(image) == sizeof raw / 2;
+	for(i = 0; i < sizeof raw / 2; i++)
+		result &= DCPU_GetMemory(cpu, 0x100 + i) == ((0x80 + i) << 8 | i);
+	DCPU_ImageClose(image);
+	result &= DCPU_LoadFile(cpu, 0x200, "dump.bin", DCPU_IMAGE_BIG_ENDIAN) == sizeof raw / 2 && DCPU_GetMemory(cpu, 0x212) == 0x1292;
+	remove("dump.bin");
+
+	return test_end(result);
+}
+
+static void count_write(DCPU_Device *device, uint16_t offset, uint16_t value)
+{
+	++*(int *) DCPU_DeviceGetData(device);
+}
+
+static int test_device_count(DCPU_State *cpu)
+{
+	/* Writes to the first of 256 devices mapped into the same page. */
+	const uint16_t		code[] = { 0x85e1, 0x9000, 0x85c3 };
+	const DCPU_DeviceClass	counter = { "counter", NULL, count_write, NULL, NULL };
+	DCPU_Device		*devices[256];
+	int			writes = 0;
+	size_t			i, created;
+
+	test_begin(cpu, NULL, 0, "256 devices on a page");
+	for(created = 0; created < sizeof devices / sizeof *devices; created++)
+	{
+		if((devices[created] = DCPU_DeviceCreate(cpu, &counter, 0x9000 + created, 1, &writes)) == NULL)
+			break;
+	}
+	DCPU_Load(cpu, 0x0000, code, sizeof code / sizeof *code);
+	DCPU_StepUntilStuck(cpu);
+	for(i = 0; i < created; i++)
+		DCPU_DeviceDestroy(devices[i]);
+
+	return test_end(created == sizeof devices / sizeof *devices && writes == 1);
+}
+
+static int test_clock(DCPU_State *cpu)
+{
+	/* Starts the clock at 60 Hz with an alarm at the second tick, and waits for the third. */
+	const uint16_t	code[] = { 0x85e1, 0x9000, 0x89e1, 0x9002, 0x8dec, 0x9001, 0xa1c1, 0x91c1, DCPU_STOP };
+	DCPU_Device	*clock;
+	size_t		cycles;
+	int		result;
+
+	test_begin(cpu, NULL, 0, "Clock device");
+	if((clock = DCPU_ClockCreate(cpu, 0x9000)) == NULL)
+		return test_end(0);
+	DCPU_Load(cpu, 0x0000, code, sizeof code / sizeof *code);
+	/* Three ticks at 60 Hz take 5000 cycles, plus the time to start the clock and finish the loop. */
+	cycles = DCPU_StepUntilStuck(cpu);
+	result = cycles >= 5000 && cycles <= 5020 && DCPU_GetMemory(cpu, 0x9001) == 3 && DCPU_GetMemory(cpu, 0x9003) == 1;
+	DCPU_DeviceDestroy(clock);
+
+	return test_end(result);
+}
+
+static int test_disk(DCPU_State *cpu)
+{
+	/* Reads sector 1 into 0x1000 and waits for it, then writes it back out to sector 0 and halts. */
+	const uint16_t	code[] = { 0x85e1, 0x9001, 0x7de1, 0x9002, 0x1000, 0x85e1, 0x9000, 0x81ec, 0x9000, 0xadc1, 0x9dc1,
+				   0x81e1, 0x9001, 0x89e1, 0x9000, 0x81ec, 0x9000, 0xcdc1, 0xbdc1, DCPU_STOP };
+	uint8_t		raw[2 * 2 * 512];
+	DCPU_Device	*disk;
+	FILE		*out;
+	size_t		i, cycles;
+	int		result;
+
+	test_begin(cpu, NULL, 0, "Disk device");
+	for(i = 0; i < sizeof raw / 2; i++)
+	{
+		raw[2 * i] = i >> 8;
+		raw[2 * i + 1] = i;
+	}
+	if((out = fopen("dump.bin", "wb")) == NULL || fwrite(raw, sizeof raw, 1, out) != 1 || fclose(out) != 0)
+		return test_end(0);
+	if((disk = DCPU_DiskCreate(cpu, 0x9000, "dump.bin", DCPU_IMAGE_BIG_ENDIAN, 0)) == NULL)
+		return test_end(0);
+	DCPU_Load(cpu, 0x0000, code, sizeof code / sizeof *code);
+	/* Both sectors are on the first track, so the transfers take no seeking. */
+	cycles = DCPU_StepUntilStuck(cpu);
+	result = cycles >= 2 * 1667 && cycles <= 2 * 1667 + 40 && DCPU_GetMemory(cpu, 0x9003) == 1 && DCPU_GetMemory(cpu, 0x9004) == 0;
+	result &= DCPU_GetMemory(cpu, 0x1000) == 512 && DCPU_GetMemory(cpu, 0x11ff) == 1023;
+	DCPU_DeviceDestroy(disk);
+	if((out = fopen("dump.bin", "rb")) == NULL || fread(raw, sizeof raw, 1, out) != 1 || fclose(out) != 0)
+		return test_end(0);
+	result &= raw[0] == 0x02 && raw[1] == 0x00 && raw[1023] == 0xff && raw[1024] == 0x02;
+	remove("dump.bin");
+
+	return test_end(result);
+}
+
+static int test_loops(DCPU_State *cpu)
+{
+	/* Copies 0x300 words from 0x1000 to 0x2000, then fills 0x100 words at 0x3000 with X, and halts. */
+	const uint16_t	code[] = { 0x7c61, 0x1000, 0x7c71, 0x2000, 0x7c21, 0x0300, 0x38f1, 0x8462, 0x8472, 0x8423, 0x802d, 0x99c1,
+				   0x7c31, 0xbeef, 0x7c71, 0x3000, 0x7c01, 0x0100, 0x0cf1, 0x8403, 0x8472, 0x800d, 0x7dc1, 0x0012, DCPU_STOP };
+	uint16_t	data[0x300];
+	DCPU_State	*other;
+	DCPU_Metrics	fast, slow;
+	size_t		i, cycles, other_cycles = 0;
+	int		result;
+
+	test_begin(cpu, NULL, 0, "Native loops");
+	if((other = DCPU_Create()) == NULL)
+		return test_end(0);
+	for(i = 0; i < sizeof data / sizeof *data; i++)
+		data[i] = i * 0x9e37;
+	DCPU_Init(other);
+	DCPU_Load(cpu, 0x0000, code, sizeof code / sizeof *code);
+	DCPU_Load(cpu, 0x1000, data, sizeof data / sizeof *data);
+	DCPU_Load(other, 0x0000, code, sizeof code / sizeof *code);
+	DCPU_Load(other, 0x1000, data, sizeof data / sizeof *data);
+	/* Stepping a cycle at a time never leaves room to run a loop natively, so the other instance interprets it. */
+	DCPU_StepCycles(cpu, 1000);
+	for(i = 0; i < 1000; i++)
+		DCPU_StepCycles(other, 1);
+	result = DCPU_GetStateHash(cpu) == DCPU_GetStateHash(other);
+	cycles = DCPU_StepInstruction(cpu) + DCPU_StepUntilStuck(cpu);
+	while(DCPU_GetPC(other) != sizeof code / sizeof *code - 1)
+		other_cycles += DCPU_StepInstruction(other);
+	other_cycles += DCPU_StepInstruction(other);
+	DCPU_StepCycles(other, 0);
+	DCPU_GetMetrics(cpu, &fast);
+	DCPU_GetMetrics(other, &slow);
+	fast.stuck = slow.stuck;
+	result &= cycles == other_cycles && DCPU_GetStateHash(cpu) == DCPU_GetStateHash(other) && memcmp(&fast, &slow, sizeof fast) == 0;
+	result &= DCPU_GetMemory(cpu, 0x22ff) == data[0x2ff] && DCPU_GetMemory(cpu, 0x30ff) == 0xbeef && DCPU_GetO(cpu) == 0;
+	DCPU_Destroy(other);
+
+	return test_end(result);
+}
+
+/* The module compiled from native.bin by the makefile; see there for the code. */
+extern const DCPU_NativeModule	native;
+
+static int test_native(DCPU_State *cpu)
+{
+	/* The code native.c was compiled from: it sums the squares of 0 to 255 into A using a
+	 * subroutine, storing the running sums at 0x1000, and halts. The limit is at 0x0009.
+	*/
+	const char	*image = "native.bin";
+	const uint16_t	limit = 0x0080;
+	DCPU_State	*other;
+	DCPU_Metrics	metrics, other_metrics;
+	size_t		cycles, other_cycles;
+	int		result;
+
+	test_begin(cpu, NULL, 0, "Natively compiled code");
+	if((other = DCPU_Create()) == NULL)
+		return test_end(0);
+	if(DCPU_LoadFile(cpu, 0x0000, image, DCPU_IMAGE_AUTO) == 0 || DCPU_LoadFile(other, 0x0000, image, DCPU_IMAGE_AUTO) == 0)
+	{
+		DCPU_Destroy(other);
+		return test_end(0);
+	}
+	result = DCPU_RunNative(cpu, &native, 1000000, &cycles) == DCPU_RUN_HALTED && DCPU_Run(other, 1000000, &other_cycles) == DCPU_RUN_HALTED;
+	result &= cycles == other_cycles && DCPU_GetStateHash(cpu) == DCPU_GetStateHash(other) && DCPU_GetMemory(cpu, 0x10ff) == 0xd580;
+	/* Compiled blocks don't count memory reads, so fewer of them shows that they ran, rather than the interpreter. */
+	DCPU_GetMetrics(cpu, &metrics);
+	DCPU_GetMetrics(other, &other_metrics);
+	result &= metrics.memory_reads < other_metrics.memory_reads;
+
+	/* Patching it to count to 0x80 halfway changes the page it was compiled from, so the rest is interpreted. */
+	DCPU_Init(cpu);
+	DCPU_Init(other);
+	DCPU_LoadFile(cpu, 0x0000, image, DCPU_IMAGE_AUTO);
+	DCPU_LoadFile(other, 0x0000, image, DCPU_IMAGE_AUTO);
+	result &= DCPU_RunNative(cpu, &native, 1000, &cycles) == DCPU_RUN_BUDGET && DCPU_Run(other, 1000, &other_cycles) == DCPU_RUN_BUDGET;
+	result &= DCPU_GetStateHash(cpu) == DCPU_GetStateHash(other);
+	DCPU_Load(cpu, 0x0009, &limit, 1);
+	DCPU_Load(other, 0x0009, &limit, 1);
+	result &= DCPU_RunNative(cpu, &native, 1000000, &cycles) == DCPU_RUN_HALTED && DCPU_Run(other, 1000000, &other_cycles) == DCPU_RUN_HALTED;
+	result &= cycles == other_cycles && DCPU_GetStateHash(cpu) == DCPU_GetStateHash(other) && DCPU_GetRegister(cpu, DCPU_REG_A) == 0x8ac0;
+	DCPU_Destroy(other);
+
+	return test_end(result);
+}
+
+/* Asks the CPU the device is attached to to stop, when the guest writes to the device. */
+static void stop_write(DCPU_Device *device, uint16_t offset, uint16_t value)
+{
+	DCPU_RequestStop(DCPU_DeviceGetData(device));
+}
+
+static int test_stop(DCPU_State *cpu)
+{
+	/* Writes to the stopping device, then counts up in A forever. */
+	const uint16_t		code[] = { 0x85e1, 0x9000, 0x8402, 0x89c1 };
+	const DCPU_DeviceClass	stopper = { "stopper", NULL, stop_write, NULL, NULL };
+	static uint16_t		wrap[0x10000];
+	DCPU_State		*other;
+	DCPU_History		*history;
+	DCPU_Device		*device;
+	size_t			cycles, i;
+	int			result;
+
+	test_begin(cpu, NULL, 0, "Stop requests");
+	if((device = DCPU_DeviceCreate(cpu, &stopper, 0x9000, 1, cpu)) == NULL)
+		return test_end(0);
+	DCPU_Load(cpu, 0x0000, code, sizeof code / sizeof *code);
+	/* The request is seen at the first jump back, once around the loop. */
+	DCPU_StepCycles(cpu, 100);
+	result = DCPU_WasStopped(cpu) && DCPU_GetPC(cpu) == 2 && DCPU_GetRegister(cpu, DCPU_REG_A) == 1;
+	result &= DCPU_Run(cpu, 100, &cycles) == DCPU_RUN_BUDGET && cycles == 100 && !DCPU_WasStopped(cpu);
+	/* That left it in the middle of an ADD, which is finished before stopping. */
+	DCPU_RequestStop(cpu);
+	result &= DCPU_Run(cpu, 100, &cycles) == DCPU_RUN_STOPPED && cycles == 1 && DCPU_GetRegister(cpu, DCPU_REG_A) == 35;
+	DCPU_RequestStop(cpu);
+	result &= DCPU_StepUntilStuck(cpu) == 0 && DCPU_WasStopped(cpu);
+	result &= DCPU_Run(cpu, 3, &cycles) == DCPU_RUN_BUDGET && DCPU_GetRegister(cpu, DCPU_REG_A) == 36;
+	/* Stepping back replays the loop without taking a request, which is left to the next run. */
+	if((history = DCPU_HistoryCreate(cpu, 1 << 20)) == NULL)
+		return test_end(0);
+	DCPU_Run(cpu, 100, &cycles);
+	DCPU_RequestStop(cpu);
+	result &= DCPU_StepBackCycles(cpu, 50) == 50 && !DCPU_WasStopped(cpu);
+	result &= DCPU_Run(cpu, 100, &cycles) == DCPU_RUN_STOPPED && cycles < 3;
+	DCPU_HistoryDestroy(history);
+	DCPU_DeviceDestroy(device);
+
+	/* Memory full of ADD A, 1 never jumps, but wraps around. Its write to the device is near the end. */
+	if((other = DCPU_Create()) == NULL || (device = DCPU_DeviceCreate(other, &stopper, 0x9000, 1, other)) == NULL)
+		return test_end(0);
+	for(i = 0; i < sizeof wrap / sizeof *wrap; i++)
+		wrap[i] = 0x8402;
+	wrap[0xfffd] = 0x85e1;
+	wrap[0xfffe] = 0x9000;
+	DCPU_Load(other, 0x0000, wrap, sizeof wrap / sizeof *wrap);
+	DCPU_StepCycles(other, 1000000);
+	result &= DCPU_WasStopped(other) && DCPU_GetPC(other) == 1 && DCPU_GetRegister(other, DCPU_REG_A) == 0xffff;
+	DCPU_DeviceDestroy(device);
+	DCPU_Destroy(other);
+
+	return test_end(result);
+}
+
+/* Stands in for a supervisor: lets the CPU run for a while, then asks it to stop. */
+static void * stop_later(void *cpu)
+{
+	const struct timespec	delay = { 0, 10000000 };
+
+	nanosleep(&delay, NULL);
+	DCPU_RequestStop(cpu);
+
+	return NULL;
+}
+
+static int test_stop_thread(DCPU_State *cpu)
+{
+	/* ADD A, 1 and SET PC, 0 loop forever, but never leave PC unchanged. */
+	const uint16_t	code[] = { 0x8402, 0x81c1 };
+	pthread_t	supervisor;
+	int		result;
+
+	test_begin(cpu, NULL, 0, "Stop from another thread");
+	DCPU_Load(cpu, 0x0000, code, sizeof code / sizeof *code);
+	if(pthread_create(&supervisor, NULL, stop_later, cpu) != 0)
+		return test_end(0);
+	DCPU_StepUntilStuck(cpu);
+	result = DCPU_WasStopped(cpu) && DCPU_GetPC(cpu) <= 1 && DCPU_GetRegister(cpu, DCPU_REG_A) != 0;
+	pthread_join(supervisor, NULL);
+
+	return test_end(result);
+}
+
 int main(void)
 {
 	DCPU_State	*cpu;
@@ -112,6 +710,26 @@ int main(void)
 		test_add(cpu);
 		test_sub(cpu);
 		test_push1(cpu);
+		test_metrics(cpu);
+		test_metrics_running(cpu);
+		test_hash(cpu);
+		test_repeat(cpu);
+		test_display(cpu);
+		test_fuzz(cpu);
+		test_fuzz_edge_count(cpu);
+		test_save_state(cpu, 0);
+		test_save_state(cpu, DCPU_SAVE_COMPRESS);
+		test_save_state_layout(cpu);
+		test_step_back(cpu);
+		test_run(cpu);
+		test_load_file(cpu);
+		test_device_count(cpu);
+		test_clock(cpu);
+		test_disk(cpu);
+		test_loops(cpu);
+		test_native(cpu);
+		test_stop(cpu);
+		test_stop_thread(cpu);
 
 		printf("%zu/%zu tests succeeded.\n", test_state.successes, test_state.tests);
 